@@ -0,0 +1,127 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+// Benchmark of the batch entry points (os_malloc_batch() and os_free_batch()) against one
+// os_malloc() and one os_free() per block. Each round decodes a number of "messages": every
+// message allocates a batch of nodes of the same size, writes to them, and the messages are
+// released in the order they were decoded.
+//
+//	./batch [nodes per message] [messages per round] [rounds] [node size]
+
+#include <stdint.h>
+#include <time.h>
+#include "osmem.h"
+
+#define DIE(assertion, call_description)				\
+	do {								\
+		if (assertion) {					\
+			fprintf(stderr, "(%s, %d): ", __FILE__, __LINE__); \
+			perror(call_description);			\
+			exit(EXIT_FAILURE);				\
+		}							\
+	} while (0)
+
+uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+// This function fills the first and the last word of every node of a message
+void touch(void **nodes, size_t count, size_t size, size_t value)
+{
+	for (size_t i = 0; i < count; i++) {
+		*(size_t *)nodes[i] = value + i;
+		*(size_t *)(nodes[i] + size - sizeof(size_t)) = value + i;
+	}
+}
+
+// This function checks that no node was overwritten by another one
+void check(void **nodes, size_t count, size_t size)
+{
+	for (size_t i = 0; i < count; i++) {
+		if (*(size_t *)nodes[i] != i ||
+			*(size_t *)(nodes[i] + size - sizeof(size_t)) != i) {
+			fprintf(stderr, "node %zu was overwritten\n", i);
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+void report(const char *name, uint64_t alloc, uint64_t release, size_t total)
+{
+	struct os_malloc_info info;
+
+	os_malloc_info(&info);
+	printf("%-10s alloc %6.1f ns, release %6.1f ns, total %6.1f ns per node, heap %zu KiB\n",
+		   name, (double)alloc / total, (double)release / total,
+		   (double)(alloc + release) / total, info.heap_size / 1024);
+}
+
+int main(int argc, char *argv[])
+{
+	size_t per_message = argc > 1 ? strtoul(argv[1], NULL, 0) : 32;
+	size_t messages = argc > 2 ? strtoul(argv[2], NULL, 0) : 1000;
+	size_t rounds = argc > 3 ? strtoul(argv[3], NULL, 0) : 1000;
+	size_t size = argc > 4 ? strtoul(argv[4], NULL, 0) : 48;
+
+	if (!per_message || !messages || !rounds || size < sizeof(size_t)) {
+		fprintf(stderr, "usage: %s [nodes per message] [messages per round] [rounds] [node size]\n",
+				argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	// The table is not allocated with os_malloc(), it would be part of the heap measured
+	size_t count = per_message * messages;
+	void **nodes = mmap(NULL, count * sizeof(void *), PROT_READ | PROT_WRITE,
+						MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	DIE(nodes == MAP_FAILED, "mmap");
+
+	uint64_t alloc = 0, release = 0, start;
+
+	for (size_t round = 0; round < rounds; round++) {
+		start = now_ns();
+		for (size_t m = 0; m < messages; m++) {
+			void **message = nodes + m * per_message;
+
+			for (size_t i = 0; i < per_message; i++) {
+				message[i] = os_malloc(size);
+				DIE(!message[i], "os_malloc");
+			}
+			touch(message, per_message, size, m * per_message);
+		}
+		alloc += now_ns() - start;
+		check(nodes, count, size);
+
+		start = now_ns();
+		for (size_t i = 0; i < count; i++)
+			os_free(nodes[i]);
+		release += now_ns() - start;
+	}
+	report("os_malloc", alloc, release, count * rounds);
+
+	alloc = release = 0;
+
+	for (size_t round = 0; round < rounds; round++) {
+		start = now_ns();
+		for (size_t m = 0; m < messages; m++) {
+			void **message = nodes + m * per_message;
+
+			DIE(os_malloc_batch(size, message, per_message) != per_message, "os_malloc_batch");
+			touch(message, per_message, size, m * per_message);
+		}
+		alloc += now_ns() - start;
+		check(nodes, count, size);
+
+		start = now_ns();
+		for (size_t m = 0; m < messages; m++)
+			os_free_batch(nodes + m * per_message, per_message);
+		release += now_ns() - start;
+	}
+	report("batch", alloc, release, count * rounds);
+
+	return 0;
+}
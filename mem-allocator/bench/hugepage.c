@@ -0,0 +1,159 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+// Random access benchmark for the huge page heaps (OSMEM_HUGEPAGES=thp or hugetlb).
+// It fills the heap with blocks linked in a random cycle and follows the links, so that
+// almost every access lands on another page. The time per access and the dTLB load misses
+// are reported, compare a run without OSMEM_HUGEPAGES with one with it.
+//
+//	./hugepage [heap MiB] [block size] [accesses]
+
+#include <fcntl.h>
+#include <linux/perf_event.h>
+#include <stdint.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include "osmem.h"
+
+#define DIE(assertion, call_description)				\
+	do {								\
+		if (assertion) {					\
+			fprintf(stderr, "(%s, %d): ", __FILE__, __LINE__); \
+			perror(call_description);			\
+			exit(EXIT_FAILURE);				\
+		}							\
+	} while (0)
+
+uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+// This function opens a counter of the dTLB load misses of the process, returns -1 if the
+// hardware counters cannot be used (in a virtual machine, for instance)
+int open_tlb_counter(void)
+{
+	struct perf_event_attr attr = {
+		.type = PERF_TYPE_HW_CACHE,
+		.size = sizeof(attr),
+		.config = PERF_COUNT_HW_CACHE_DTLB | PERF_COUNT_HW_CACHE_OP_READ << 8 |
+				  PERF_COUNT_HW_CACHE_RESULT_MISS << 16,
+		.disabled = 1,
+		.exclude_kernel = 1,
+		.exclude_hv = 1,
+	};
+
+	return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+// This function reads a "<name> <value> kB" line of /proc/self/smaps_rollup
+size_t smaps_kb(const char *name)
+{
+	char buf[4096];
+	int fd = open("/proc/self/smaps_rollup", O_RDONLY);
+
+	if (fd < 0)
+		return 0;
+
+	ssize_t len = read(fd, buf, sizeof(buf) - 1);
+
+	close(fd);
+	if (len <= 0)
+		return 0;
+	buf[len] = '\0';
+
+	char *line = strstr(buf, name);
+
+	return line ? strtoul(line + strlen(name) + 1, NULL, 10) : 0;
+}
+
+// xorshift, the benchmark must not depend on the state of rand()
+uint64_t next_random(uint64_t *state)
+{
+	*state ^= *state << 13;
+	*state ^= *state >> 7;
+	*state ^= *state << 17;
+
+	return *state;
+}
+
+int main(int argc, char *argv[])
+{
+	size_t heap_mb = argc > 1 ? strtoul(argv[1], NULL, 0) : 1024;
+	size_t block_size = argc > 2 ? strtoul(argv[2], NULL, 0) : 4096;
+	size_t accesses = argc > 3 ? strtoul(argv[3], NULL, 0) : 20000000;
+	size_t count = (heap_mb << 20) / block_size;
+
+	if (block_size < sizeof(void *) || !count || !accesses) {
+		fprintf(stderr, "usage: %s [heap MiB] [block size] [accesses]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	// The list of the blocks is not allocated with os_malloc(), it would share their pages
+	void ***blocks = mmap(NULL, count * sizeof(void *), PROT_READ | PROT_WRITE,
+						  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	DIE(blocks == MAP_FAILED, "mmap");
+
+	uint64_t start = now_ns();
+
+	for (size_t i = 0; i < count; i++) {
+		blocks[i] = os_malloc(block_size);
+		DIE(!blocks[i], "os_malloc");
+		memset(blocks[i], 0, block_size);
+	}
+
+	uint64_t fill = now_ns() - start;
+
+	// Link the blocks in a random cycle (Sattolo's shuffle)
+	uint64_t state = 88172645463325252UL;
+
+	for (size_t i = count - 1; i > 0; i--) {
+		size_t j = next_random(&state) % i;
+		void **tmp = blocks[i];
+
+		blocks[i] = blocks[j];
+		blocks[j] = tmp;
+	}
+	for (size_t i = 0; i < count; i++)
+		*blocks[i] = blocks[(i + 1) % count];
+
+	int counter = open_tlb_counter();
+	void **ptr = blocks[0];
+
+	if (counter >= 0)
+		ioctl(counter, PERF_EVENT_IOC_ENABLE, 0);
+	start = now_ns();
+
+	for (size_t i = 0; i < accesses; i++)
+		ptr = *ptr;
+
+	uint64_t walk = now_ns() - start;
+	uint64_t misses = 0;
+
+	if (counter >= 0) {
+		ioctl(counter, PERF_EVENT_IOC_DISABLE, 0);
+		if (read(counter, &misses, sizeof(misses)) != sizeof(misses))
+			counter = -1;
+		close(counter);
+	}
+
+	char *huge_pages = getenv("OSMEM_HUGEPAGES");
+
+	printf("huge pages: %s\n", huge_pages ? huge_pages : "none");
+	printf("heap: %zu blocks of %zu bytes, filled in %.1f ms\n", count, block_size, fill / 1e6);
+	printf("anonymous huge pages: %zu KiB, hugetlb: %zu KiB\n",
+		   smaps_kb("AnonHugePages:"), smaps_kb("Private_Hugetlb:"));
+	printf("random walk: %zu accesses, %.2f ns per access\n", accesses, (double)walk / accesses);
+	if (counter >= 0)
+		printf("dTLB load misses: %lu (%.3f per access)\n", misses, (double)misses / accesses);
+	else
+		printf("dTLB load misses: hardware counters not available\n");
+
+	// Keeps the walk from being optimized out
+	return ptr == NULL;
+}
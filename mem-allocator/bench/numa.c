@@ -0,0 +1,197 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+// Benchmark of the placement of the heap on the NUMA nodes. A thread on the first node allocates
+// blocks, writes to them and frees them, then a thread on the last node allocates and writes
+// blocks of the same sizes. With a single heap, the second thread gets back the pages of the
+// first node. With OSMEM_ARENA_POLICY=numa, it allocates from the arena of its own node. The
+// node of the page of every block is read with move_pages(), and a pass reading all the blocks
+// is timed. libosmem.so must be built with THREAD_SAFE=1.
+//
+//	./numa [blocks] [max size]
+//
+// Without a second node (numactl --hardware), boot with numa=fake=2 to emulate one.
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include "osmem.h"
+
+#define DIE(assertion, call_description)				\
+	do {								\
+		if (assertion) {					\
+			fprintf(stderr, "(%s, %d): ", __FILE__, __LINE__); \
+			perror(call_description);			\
+			exit(EXIT_FAILURE);				\
+		}							\
+	} while (0)
+
+#define MAX_NODES 64
+
+struct phase {
+	const char *name;
+	int cpu;
+	int node;
+	// Blocks on the node of the thread, and time of the pass reading them
+	size_t local;
+	uint64_t read_ns;
+	int free_blocks;
+};
+
+static void **blocks;
+static size_t *sizes;
+static void **pages;
+static int *status;
+static size_t count;
+
+uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+// xorshift, the benchmark must not depend on the state of rand()
+uint64_t next_random(uint64_t *state)
+{
+	*state ^= *state << 13;
+	*state ^= *state >> 7;
+	*state ^= *state << 17;
+
+	return *state;
+}
+
+// This function returns the first CPU of a node, or -1 if it has none (or there is no such node)
+int node_cpu(int node)
+{
+	char path[64], buf[64];
+
+	snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+
+	int fd = open(path, O_RDONLY);
+
+	if (fd < 0)
+		return -1;
+
+	ssize_t len = read(fd, buf, sizeof(buf) - 1);
+
+	close(fd);
+	if (len <= 0 || buf[0] < '0' || buf[0] > '9')
+		return -1;
+	buf[len] = '\0';
+
+	return atoi(buf);
+}
+
+void *run_phase(void *arg)
+{
+	struct phase *phase = arg;
+
+	for (size_t i = 0; i < count; i++) {
+		blocks[i] = os_malloc(sizes[i]);
+		DIE(!blocks[i], "os_malloc");
+		memset(blocks[i], i, sizes[i]);
+	}
+
+	// The node of the page of every block
+	for (size_t i = 0; i < count; i++)
+		pages[i] = blocks[i];
+	DIE(syscall(SYS_move_pages, 0, count, pages, NULL, status, 0) < 0, "move_pages");
+	for (size_t i = 0; i < count; i++)
+		phase->local += status[i] == phase->node;
+
+	uint64_t start = now_ns();
+	volatile unsigned long sum = 0;
+
+	for (size_t i = 0; i < count; i++)
+		for (size_t j = 0; j < sizes[i]; j += sizeof(unsigned long))
+			sum += *(unsigned long *)(blocks[i] + j);
+	phase->read_ns = now_ns() - start;
+
+	if (phase->free_blocks)
+		for (size_t i = 0; i < count; i++)
+			os_free(blocks[i]);
+
+	return NULL;
+}
+
+void start_phase(struct phase *phase)
+{
+	pthread_attr_t attr;
+	pthread_t thread;
+	cpu_set_t cpus;
+
+	CPU_ZERO(&cpus);
+	CPU_SET(phase->cpu, &cpus);
+	pthread_attr_init(&attr);
+	pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+
+	DIE(pthread_create(&thread, &attr, run_phase, phase), "pthread_create");
+	pthread_join(thread, NULL);
+	pthread_attr_destroy(&attr);
+
+	printf("%-9s CPU %3d, node %2d: %5.1f%% of the blocks on its node, read %6.2f ns per block\n",
+		   phase->name, phase->cpu, phase->node, 100.0 * phase->local / count,
+		   (double)phase->read_ns / count);
+}
+
+int main(int argc, char *argv[])
+{
+	count = argc > 1 ? strtoul(argv[1], NULL, 0) : 100000;
+	size_t max_size = argc > 2 ? strtoul(argv[2], NULL, 0) : 4096;
+
+	if (!count || max_size < 16) {
+		fprintf(stderr, "usage: %s [blocks] [max size]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	// The producer runs on the first node with a CPU, the consumer on the last one
+	struct phase producer = { .name = "producer", .cpu = -1, .free_blocks = 1 };
+	struct phase consumer = { .name = "consumer", .cpu = -1 };
+
+	for (int node = 0; node < MAX_NODES; node++) {
+		int cpu = node_cpu(node);
+
+		if (cpu < 0)
+			continue;
+		if (producer.cpu < 0) {
+			producer.cpu = cpu;
+			producer.node = node;
+		}
+		consumer.cpu = cpu;
+		consumer.node = node;
+	}
+	DIE(producer.cpu < 0, "no NUMA node with a CPU");
+	if (producer.node == consumer.node)
+		printf("a single NUMA node, all the blocks are local (boot with numa=fake=2 to emulate two)\n");
+
+	// The tables are not allocated with os_malloc(), they would be part of the heap measured
+	blocks = mmap(NULL, count * sizeof(void *), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	sizes = mmap(NULL, count * sizeof(size_t), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	pages = mmap(NULL, count * sizeof(void *), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	status = mmap(NULL, count * sizeof(int), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	DIE(blocks == MAP_FAILED || sizes == MAP_FAILED || pages == MAP_FAILED || status == MAP_FAILED, "mmap");
+
+	uint64_t state = 88172645463325252UL;
+
+	for (size_t i = 0; i < count; i++)
+		sizes[i] = 16 + next_random(&state) % (max_size - 15);
+
+	start_phase(&producer);
+	start_phase(&consumer);
+
+	for (int idx = 0; idx < os_arena_count(); idx++) {
+		struct os_arena_stats stats;
+
+		os_arena_stats(idx, &stats);
+		if (stats.heap_size)
+			printf("arena %2d: node %2d, %zu KiB\n", idx, stats.node, stats.heap_size / 1024);
+	}
+
+	return 0;
+}
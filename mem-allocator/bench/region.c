@@ -0,0 +1,139 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+// Benchmark of the bump-pointer regions (os_region_alloc()) against os_malloc() and os_free()
+// of every object. Each round allocates the objects of a "request" (random sizes between 16
+// and the maximum size), writes to them and then releases them all: one os_free() per object,
+// or a single os_region_reset().
+//
+//	./region [objects per round] [rounds] [max size]
+
+#include <stdint.h>
+#include <time.h>
+#include "osmem.h"
+
+#define DIE(assertion, call_description)				\
+	do {								\
+		if (assertion) {					\
+			fprintf(stderr, "(%s, %d): ", __FILE__, __LINE__); \
+			perror(call_description);			\
+			exit(EXIT_FAILURE);				\
+		}							\
+	} while (0)
+
+uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+// xorshift, the benchmark must not depend on the state of rand()
+uint64_t next_random(uint64_t *state)
+{
+	*state ^= *state << 13;
+	*state ^= *state >> 7;
+	*state ^= *state << 17;
+
+	return *state;
+}
+
+// This function fills the first and the last word of an object, as a program would
+void touch(void *ptr, size_t size, size_t value)
+{
+	*(size_t *)ptr = value;
+	*(size_t *)(ptr + size - sizeof(size_t)) = value;
+}
+
+// This function checks that no object was overwritten by another one
+void check(void **objects, size_t *sizes, size_t count)
+{
+	for (size_t i = 0; i < count; i++) {
+		if (*(size_t *)objects[i] != i ||
+			*(size_t *)(objects[i] + sizes[i] - sizeof(size_t)) != i) {
+			fprintf(stderr, "object %zu was overwritten\n", i);
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+void report(const char *name, uint64_t alloc, uint64_t release, size_t total)
+{
+	struct os_malloc_info info;
+
+	os_malloc_info(&info);
+	printf("%-10s alloc %6.1f ns, release %6.1f ns, total %6.1f ns per object, heap %zu KiB\n",
+		   name, (double)alloc / total, (double)release / total,
+		   (double)(alloc + release) / total, info.heap_size / 1024);
+}
+
+int main(int argc, char *argv[])
+{
+	size_t count = argc > 1 ? strtoul(argv[1], NULL, 0) : 10000;
+	size_t rounds = argc > 2 ? strtoul(argv[2], NULL, 0) : 1000;
+	size_t max_size = argc > 3 ? strtoul(argv[3], NULL, 0) : 256;
+
+	if (!count || !rounds || max_size < 16) {
+		fprintf(stderr, "usage: %s [objects per round] [rounds] [max size]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	// The tables are not allocated with os_malloc(), they would be part of the heap measured
+	void **objects = mmap(NULL, count * sizeof(void *), PROT_READ | PROT_WRITE,
+						  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	size_t *sizes = mmap(NULL, count * sizeof(size_t), PROT_READ | PROT_WRITE,
+						 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	DIE(objects == MAP_FAILED || sizes == MAP_FAILED, "mmap");
+
+	// Both runs allocate the same sizes
+	uint64_t state = 88172645463325252UL;
+
+	for (size_t i = 0; i < count; i++)
+		sizes[i] = 16 + next_random(&state) % (max_size - 15);
+
+	uint64_t alloc = 0, release = 0, start;
+
+	for (size_t round = 0; round < rounds; round++) {
+		start = now_ns();
+		for (size_t i = 0; i < count; i++) {
+			objects[i] = os_malloc(sizes[i]);
+			DIE(!objects[i], "os_malloc");
+			touch(objects[i], sizes[i], i);
+		}
+		alloc += now_ns() - start;
+		check(objects, sizes, count);
+
+		start = now_ns();
+		for (size_t i = 0; i < count; i++)
+			os_free(objects[i]);
+		release += now_ns() - start;
+	}
+	report("os_malloc", alloc, release, count * rounds);
+
+	struct os_region *region = os_region_create(0);
+
+	DIE(!region, "os_region_create");
+	alloc = release = 0;
+
+	for (size_t round = 0; round < rounds; round++) {
+		start = now_ns();
+		for (size_t i = 0; i < count; i++) {
+			objects[i] = os_region_alloc(region, sizes[i]);
+			DIE(!objects[i], "os_region_alloc");
+			touch(objects[i], sizes[i], i);
+		}
+		alloc += now_ns() - start;
+		check(objects, sizes, count);
+
+		start = now_ns();
+		os_region_reset(region);
+		release += now_ns() - start;
+	}
+	report("os_region", alloc, release, count * rounds);
+
+	os_region_destroy(region);
+
+	return 0;
+}
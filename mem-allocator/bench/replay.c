@@ -0,0 +1,465 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+// Replays an allocation trace recorded with trace.so against libosmem.so (or against the
+// allocator of libc with -s) and reports the throughput, the latency of the calls, the peak
+// RSS and the fragmentation of the heap.
+//
+// The replay itself never calls malloc(): libc would move the program break under the
+// heap of libosmem.so. The trace and the tables are mapped with mmap() and the report is
+// written with the printf() implementation in utils/.
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <time.h>
+#include "osmem.h"
+
+#define DIE(assertion, call_description)				\
+	do {								\
+		if (assertion) {					\
+			fprintf(stderr, "(%s, %d): ", __FILE__, __LINE__); \
+			perror(call_description);			\
+			exit(EXIT_FAILURE);				\
+		}							\
+	} while (0)
+
+#define NO_SLOT UINT32_MAX
+
+// Every allocation of the trace gets a slot that holds its block during the replay
+struct op {
+	char type;
+	uint32_t slot;
+	// Slot of the block given to realloc(), or freed
+	uint32_t old_slot;
+	size_t arg1;
+	size_t arg2;
+};
+
+struct allocator {
+	const char *name;
+	void *(*malloc)(size_t size);
+	void (*free)(void *ptr);
+	void *(*calloc)(size_t nmemb, size_t size);
+	void *(*realloc)(void *ptr, size_t size);
+	void *(*memalign)(size_t alignment, size_t size);
+	int (*info)(struct os_malloc_info *info);
+};
+
+static const struct allocator osmem = {
+	"osmem", os_malloc, os_free, os_calloc, os_realloc, os_memalign, os_malloc_info,
+};
+
+static const struct allocator libc = {
+	"libc", malloc, free, calloc, realloc, aligned_alloc, NULL,
+};
+
+// Open addressing table from the recorded pointers of the live blocks to their slots
+struct ptr_table {
+	size_t mask;
+	uintptr_t *keys;
+	uint32_t *slots;
+};
+
+// The tables are populated right away, so that their pages are counted in the RSS before the replay
+void *map_array(size_t count, size_t size)
+{
+	void *ptr = mmap(NULL, count * size, PROT_READ | PROT_WRITE,
+					 MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+
+	DIE(ptr == MAP_FAILED, "mmap");
+
+	return ptr;
+}
+
+size_t ptr_hash(struct ptr_table *table, uintptr_t key)
+{
+	return (key >> 4) * 0x9e3779b97f4a7c15UL >> 20 & table->mask;
+}
+
+size_t ptr_lookup(struct ptr_table *table, uintptr_t key)
+{
+	size_t pos = ptr_hash(table, key);
+
+	while (table->keys[pos] && table->keys[pos] != key)
+		pos = (pos + 1) & table->mask;
+
+	return pos;
+}
+
+uint32_t ptr_get(struct ptr_table *table, uintptr_t key)
+{
+	size_t pos = ptr_lookup(table, key);
+
+	return table->keys[pos] ? table->slots[pos] : NO_SLOT;
+}
+
+void ptr_set(struct ptr_table *table, uintptr_t key, uint32_t slot)
+{
+	size_t pos = ptr_lookup(table, key);
+
+	table->keys[pos] = key;
+	table->slots[pos] = slot;
+}
+
+// This function removes a key and moves back the keys after it that would not be found anymore
+void ptr_del(struct ptr_table *table, uintptr_t key)
+{
+	size_t pos = ptr_lookup(table, key);
+
+	if (!table->keys[pos])
+		return;
+
+	for (size_t next = (pos + 1) & table->mask; table->keys[next]; next = (next + 1) & table->mask) {
+		size_t home = ptr_hash(table, table->keys[next]);
+
+		// The key at next can fill the hole if its home is not between the hole and next
+		if ((next > pos && (home <= pos || home > next)) || (next < pos && home <= pos && home > next)) {
+			table->keys[pos] = table->keys[next];
+			table->slots[pos] = table->slots[next];
+			pos = next;
+		}
+	}
+	table->keys[pos] = 0;
+}
+
+size_t parse_hex(const char **pos, const char *end)
+{
+	size_t value = 0;
+
+	while (*pos < end && **pos == ' ')
+		(*pos)++;
+
+	for (; *pos < end; (*pos)++) {
+		char c = **pos;
+
+		if (c >= '0' && c <= '9')
+			value = value * 16 + c - '0';
+		else if (c >= 'a' && c <= 'f')
+			value = value * 16 + c - 'a' + 10;
+		else
+			break;
+	}
+
+	return value;
+}
+
+// This function turns the trace into a list of operations on slots, returns their number
+size_t parse_trace(const char *trace, size_t len, struct op **ops_out, size_t **sizes_out,
+				   size_t *slots_out)
+{
+	size_t lines = 0;
+
+	for (size_t i = 0; i < len; i++)
+		lines += trace[i] == '\n';
+
+	size_t capacity = 1;
+
+	while (capacity < 2 * lines + 2)
+		capacity *= 2;
+
+	struct ptr_table table = {
+		.mask = capacity - 1,
+		.keys = map_array(capacity, sizeof(uintptr_t)),
+		.slots = map_array(capacity, sizeof(uint32_t)),
+	};
+	struct op *ops = map_array(lines + 1, sizeof(*ops));
+	size_t *sizes = map_array(lines + 1, sizeof(*sizes));
+	size_t count = 0;
+	uint32_t slots = 0;
+
+	for (const char *pos = trace, *end = trace + len; pos < end; pos++) {
+		struct op *op = &ops[count];
+		char type = *pos++;
+		uintptr_t ptr = parse_hex(&pos, end);
+		size_t a = parse_hex(&pos, end);
+		size_t b = parse_hex(&pos, end);
+		uint32_t old_slot = NO_SLOT;
+
+		// Lines that are not operations are skipped
+		while (pos < end && *pos != '\n')
+			pos++;
+
+		switch (type) {
+		case 'm':
+			b = a;
+			break;
+		case 'c':
+			sizes[slots] = a * b;
+			break;
+		case 'a':
+			break;
+		case 'r':
+			if (a) {
+				old_slot = ptr_get(&table, a);
+				ptr_del(&table, a);
+			}
+			// Freeing through realloc()
+			if (!ptr) {
+				if (old_slot == NO_SLOT)
+					continue;
+				type = 'f';
+			}
+			a = b;
+			break;
+		case 'f':
+			old_slot = ptr_get(&table, ptr);
+			// Blocks allocated before the recording started are not known
+			if (old_slot == NO_SLOT)
+				continue;
+			ptr_del(&table, ptr);
+			ptr = 0;
+			break;
+		default:
+			continue;
+		}
+
+		op->type = type;
+		op->old_slot = old_slot;
+		op->slot = NO_SLOT;
+		op->arg1 = a;
+		op->arg2 = b;
+
+		if (ptr) {
+			// A block that was not freed in the trace, because of a realloc() racing with
+			// another thread, is left allocated
+			op->slot = slots;
+			if (type != 'c')
+				sizes[slots] = b;
+			ptr_set(&table, ptr, slots++);
+		}
+		count++;
+	}
+
+	munmap(table.keys, capacity * sizeof(uintptr_t));
+	munmap(table.slots, capacity * sizeof(uint32_t));
+
+	*ops_out = ops;
+	*sizes_out = sizes;
+	*slots_out = slots;
+
+	return count;
+}
+
+uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+// This function returns the k-th smallest latency, the array is reordered
+uint32_t select_nth(uint32_t *values, size_t count, size_t k)
+{
+	size_t lo = 0, hi = count - 1;
+
+	while (lo < hi) {
+		uint32_t pivot = values[lo + (hi - lo) / 2];
+		size_t i = lo, j = hi;
+
+		while (i <= j) {
+			while (values[i] < pivot)
+				i++;
+			while (values[j] > pivot)
+				j--;
+			if (i <= j) {
+				uint32_t tmp = values[i];
+
+				values[i++] = values[j];
+				values[j] = tmp;
+				if (j == 0)
+					break;
+				j--;
+			}
+		}
+
+		if (k <= j)
+			hi = j;
+		else if (k >= i)
+			lo = i;
+		else
+			break;
+	}
+
+	return values[k];
+}
+
+// This function reads a "<name>: <value> kB" line of /proc/self/status
+size_t proc_status_kb(const char *name)
+{
+	char buf[4096];
+	int fd = open("/proc/self/status", O_RDONLY);
+
+	if (fd < 0)
+		return 0;
+
+	ssize_t len = read(fd, buf, sizeof(buf) - 1);
+
+	close(fd);
+	if (len <= 0)
+		return 0;
+	buf[len] = '\0';
+
+	char *line = strstr(buf, name);
+
+	return line ? strtoul(line + strlen(name) + 1, NULL, 10) : 0;
+}
+
+// This function resets the peak RSS of the process to its current RSS
+void reset_peak_rss(void)
+{
+	int fd = open("/proc/self/clear_refs", O_WRONLY);
+
+	if (fd < 0)
+		return;
+	if (write(fd, "5", 1) < 0)
+		fprintf(stderr, "cannot reset the peak RSS, it includes the loading of the trace\n");
+	close(fd);
+}
+
+// This function writes to every page of a new block, like a program would use it
+void touch(void *ptr, size_t size)
+{
+	for (size_t off = 0; off < size; off += 4096)
+		((volatile char *)ptr)[off] = 1;
+}
+
+void print_info(const char *when, struct os_malloc_info *info)
+{
+	printf("%s: heap %zu KiB, in use %zu KiB (%zu KiB mapped), free %zu KiB, largest free block %zu KiB, fragmentation %.3f\n",
+		   when, info->heap_size >> 10, info->in_use_bytes >> 10, info->mapped_bytes >> 10,
+		   info->free_bytes >> 10, info->largest_free >> 10, info->fragmentation);
+}
+
+void usage(const char *name)
+{
+	fprintf(stderr, "usage: %s [-s] <trace>\n", name);
+	fprintf(stderr, "  -s  replay against the allocator of libc instead of libosmem.so\n");
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+	const struct allocator *alloc = &osmem;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "s")) != -1) {
+		if (opt != 's')
+			usage(argv[0]);
+		alloc = &libc;
+	}
+	if (optind != argc - 1)
+		usage(argv[0]);
+
+	int fd = open(argv[optind], O_RDONLY);
+	struct stat st;
+
+	DIE(fd < 0, argv[optind]);
+	DIE(fstat(fd, &st) < 0, "fstat");
+	if (st.st_size == 0) {
+		fprintf(stderr, "%s: empty trace\n", argv[optind]);
+		return EXIT_FAILURE;
+	}
+
+	char *trace = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+	DIE(trace == MAP_FAILED, "mmap");
+	close(fd);
+
+	struct op *ops;
+	size_t *sizes;
+	size_t slots;
+	size_t count = parse_trace(trace, st.st_size, &ops, &sizes, &slots);
+
+	munmap(trace, st.st_size);
+	if (!count) {
+		fprintf(stderr, "%s: no allocations in the trace\n", argv[optind]);
+		return EXIT_FAILURE;
+	}
+
+	// The operation after which the most bytes are in use, the heap is inspected there
+	size_t live = 0, peak_live = 0, peak_op = 0;
+
+	for (size_t i = 0; i < count; i++) {
+		if (ops[i].old_slot != NO_SLOT)
+			live -= sizes[ops[i].old_slot];
+		if (ops[i].slot != NO_SLOT)
+			live += sizes[ops[i].slot];
+		if (live > peak_live) {
+			peak_live = live;
+			peak_op = i;
+		}
+	}
+
+	void **blocks = map_array(slots + 1, sizeof(void *));
+	uint32_t *latency = map_array(count, sizeof(uint32_t));
+
+	size_t rss_before = proc_status_kb("VmRSS:");
+
+	reset_peak_rss();
+
+	struct os_malloc_info peak_info, end_info;
+	uint64_t total = 0;
+
+	for (size_t i = 0; i < count; i++) {
+		struct op *op = &ops[i];
+		void *old = op->old_slot != NO_SLOT ? blocks[op->old_slot] : NULL;
+		void *ptr = NULL;
+		uint64_t start = now_ns();
+
+		switch (op->type) {
+		case 'm':
+			ptr = alloc->malloc(op->arg1);
+			break;
+		case 'c':
+			ptr = alloc->calloc(op->arg1, op->arg2);
+			break;
+		case 'a':
+			ptr = alloc->memalign(op->arg1, op->arg2);
+			break;
+		case 'r':
+			ptr = alloc->realloc(old, op->arg1);
+			break;
+		case 'f':
+			alloc->free(old);
+			break;
+		}
+
+		uint64_t elapsed = now_ns() - start;
+
+		total += elapsed;
+		latency[i] = elapsed > UINT32_MAX ? UINT32_MAX : elapsed;
+
+		if (op->old_slot != NO_SLOT && (op->type == 'f' || ptr))
+			blocks[op->old_slot] = NULL;
+		if (op->slot != NO_SLOT) {
+			blocks[op->slot] = ptr;
+			if (ptr)
+				touch(ptr, sizes[op->slot]);
+		}
+
+		if (i == peak_op && alloc->info)
+			alloc->info(&peak_info);
+	}
+
+	if (alloc->info)
+		alloc->info(&end_info);
+
+	printf("allocator: %s\n", alloc->name);
+	printf("operations: %zu in %.3f ms, %.3f Mops/s\n", count, total / 1e6, count * 1e3 / total);
+	printf("latency: p50 %u ns, p99 %u ns, max %u ns\n", select_nth(latency, count, count / 2),
+		   select_nth(latency, count, count * 99 / 100), select_nth(latency, count, count - 1));
+	printf("peak requested: %zu KiB\n", peak_live >> 10);
+	size_t peak_rss = proc_status_kb("VmHWM:");
+
+	printf("peak RSS: %zu KiB, %zu KiB more than before the replay\n", peak_rss, peak_rss - rss_before);
+	if (alloc->info) {
+		print_info("at peak", &peak_info);
+		print_info("at end", &end_info);
+	}
+
+	return 0;
+}
@@ -0,0 +1,412 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+// Multithreaded benchmark suite, modelled on the usual allocator benchmarks:
+//
+//	larson		server churn: threads free random blocks and replace them, and keep handing
+//			their sets of blocks over to each other, so many blocks are freed by another
+//			thread than the one that allocated them
+//	threadtest	every thread allocates batches of 64 byte blocks and frees them
+//	cache-scratch	every thread frees a small block allocated by the main thread (next to the
+//			blocks of the others), then allocates, writes and frees small blocks:
+//			an allocator that hands out blocks sharing a cache line to several threads
+//			makes them slow each other down
+//	random		random mix of malloc(), calloc(), realloc() and free() of 8 bytes to 64 KiB
+//
+// Each workload runs for a fixed time with 1, 2, 4... up to the given number of threads, in a
+// new process every time, and reports the allocator calls per second, the speedup over one
+// thread and the peak RSS. libosmem.so must be built with THREAD_SAFE=1, make bench does it.
+//
+//	./threads [-s] [-t threads] [-d seconds] [workload...]
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/wait.h>
+#include <time.h>
+#include "osmem.h"
+
+#define DIE(assertion, call_description)				\
+	do {								\
+		if (assertion) {					\
+			fprintf(stderr, "(%s, %d): ", __FILE__, __LINE__); \
+			perror(call_description);			\
+			exit(EXIT_FAILURE);				\
+		}							\
+	} while (0)
+
+#define MAX_THREADS 64
+
+#define LARSON_SLOTS 1000
+#define LARSON_MIN 8
+#define LARSON_MAX 1024
+// Number of operations between two hand-overs of the blocks of a thread
+#define LARSON_EPOCH 10000
+
+#define THREADTEST_BATCH 1000
+#define THREADTEST_SIZE 64
+
+#define SCRATCH_SIZE 8
+#define SCRATCH_WRITES 100
+
+#define RANDOM_SLOTS 4096
+
+struct allocator {
+	const char *name;
+	void *(*malloc)(size_t size);
+	void (*free)(void *ptr);
+	void *(*calloc)(size_t nmemb, size_t size);
+	void *(*realloc)(void *ptr, size_t size);
+};
+
+static const struct allocator osmem = {
+	"osmem", os_malloc, os_free, os_calloc, os_realloc,
+};
+
+static const struct allocator libc = {
+	"libc", malloc, free, calloc, realloc,
+};
+
+static const struct allocator *alloc = &osmem;
+
+// Each thread counts its calls in its own cache line
+struct worker {
+	pthread_t thread;
+	uint64_t calls;
+	uint64_t random;
+	void *given;
+} __attribute__((aligned(64)));
+
+static struct worker workers[MAX_THREADS];
+static volatile int stop;
+
+// The set of blocks of larson that is not held by any thread
+static void **larson_parked;
+
+struct result {
+	double calls_per_sec;
+	size_t peak_rss_kb;
+};
+
+uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+// xorshift, the benchmark must not depend on the state of rand()
+uint64_t next_random(struct worker *self)
+{
+	self->random ^= self->random << 13;
+	self->random ^= self->random >> 7;
+	self->random ^= self->random << 17;
+
+	return self->random;
+}
+
+int stopped(void)
+{
+	return __atomic_load_n(&stop, __ATOMIC_RELAXED);
+}
+
+// The tables of the workloads are not allocated with the allocator under test
+void *map_array(size_t count, size_t size)
+{
+	void *ptr = mmap(NULL, count * size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	DIE(ptr == MAP_FAILED, "mmap");
+
+	return ptr;
+}
+
+size_t larson_size(struct worker *self)
+{
+	return LARSON_MIN + next_random(self) % (LARSON_MAX - LARSON_MIN + 1);
+}
+
+void *larson(struct worker *self)
+{
+	void **blocks = map_array(LARSON_SLOTS, sizeof(void *));
+
+	for (int i = 0; i < LARSON_SLOTS; i++)
+		blocks[i] = alloc->malloc(larson_size(self));
+
+	while (!stopped()) {
+		for (int i = 0; i < LARSON_EPOCH; i++) {
+			size_t slot = next_random(self) % LARSON_SLOTS;
+
+			alloc->free(blocks[slot]);
+			blocks[slot] = alloc->malloc(larson_size(self));
+			*(char *)blocks[slot] = 1;
+		}
+		self->calls += 2 * LARSON_EPOCH;
+
+		// Take over the blocks left by another thread, and leave these ones
+		blocks = __atomic_exchange_n(&larson_parked, blocks, __ATOMIC_ACQ_REL);
+	}
+
+	return NULL;
+}
+
+void *threadtest(struct worker *self)
+{
+	void **blocks = map_array(THREADTEST_BATCH, sizeof(void *));
+
+	while (!stopped()) {
+		for (int i = 0; i < THREADTEST_BATCH; i++) {
+			blocks[i] = alloc->malloc(THREADTEST_SIZE);
+			*(char *)blocks[i] = 1;
+		}
+		for (int i = 0; i < THREADTEST_BATCH; i++)
+			alloc->free(blocks[i]);
+		self->calls += 2 * THREADTEST_BATCH;
+	}
+
+	return NULL;
+}
+
+void *cache_scratch(struct worker *self)
+{
+	alloc->free(self->given);
+
+	while (!stopped()) {
+		for (int i = 0; i < 100; i++) {
+			volatile char *ptr = alloc->malloc(SCRATCH_SIZE);
+
+			for (int j = 0; j < SCRATCH_WRITES; j++)
+				ptr[j % SCRATCH_SIZE]++;
+			alloc->free((void *)ptr);
+		}
+		self->calls += 2 * 100;
+	}
+
+	return NULL;
+}
+
+// Sizes from 8 bytes to 64 KiB, as many of each power of two
+size_t random_size(struct worker *self)
+{
+	uint64_t random = next_random(self);
+	int order = 3 + random % 14;
+
+	return (1UL << order) + (random >> 8) % (1UL << order);
+}
+
+void *random_mix(struct worker *self)
+{
+	void **blocks = map_array(RANDOM_SLOTS, sizeof(void *));
+
+	while (!stopped()) {
+		for (int i = 0; i < 1000; i++) {
+			uint64_t random = next_random(self);
+			size_t slot = random % RANDOM_SLOTS;
+			size_t size = random_size(self);
+
+			if (!blocks[slot]) {
+				blocks[slot] = (random >> 32) % 4 ? alloc->malloc(size) : alloc->calloc(1, size);
+			} else if ((random >> 32) % 2) {
+				alloc->free(blocks[slot]);
+				blocks[slot] = NULL;
+				continue;
+			} else {
+				blocks[slot] = alloc->realloc(blocks[slot], size);
+			}
+			DIE(!blocks[slot], "allocation");
+			*(char *)blocks[slot] = 1;
+		}
+		self->calls += 1000;
+	}
+
+	return NULL;
+}
+
+struct workload {
+	const char *name;
+	void *(*run)(struct worker *self);
+};
+
+static const struct workload workloads[] = {
+	{ "larson", larson },
+	{ "threadtest", threadtest },
+	{ "cache-scratch", cache_scratch },
+	{ "random", random_mix },
+};
+
+#define N_WORKLOADS (sizeof(workloads) / sizeof(workloads[0]))
+
+// This function reads a "<name>: <value> kB" line of /proc/self/status
+size_t proc_status_kb(const char *name)
+{
+	char buf[4096];
+	int fd = open("/proc/self/status", O_RDONLY);
+
+	if (fd < 0)
+		return 0;
+
+	ssize_t len = read(fd, buf, sizeof(buf) - 1);
+
+	close(fd);
+	if (len <= 0)
+		return 0;
+	buf[len] = '\0';
+
+	char *line = strstr(buf, name);
+
+	return line ? strtoul(line + strlen(name) + 1, NULL, 10) : 0;
+}
+
+// This function runs a workload with the given number of threads for duration_ns,
+// in the process forked for it
+struct result run_workload(const struct workload *workload, int threads, uint64_t duration_ns)
+{
+	if (workload->run == larson)
+		larson_parked = map_array(LARSON_SLOTS, sizeof(void *));
+
+	for (int i = 0; i < threads; i++) {
+		workers[i].random = 88172645463325252UL + i * 0x9e3779b97f4a7c15UL;
+		// Neighbouring blocks, each freed by another thread
+		if (workload->run == cache_scratch)
+			workers[i].given = alloc->malloc(SCRATCH_SIZE);
+	}
+
+	uint64_t start = now_ns();
+
+	for (int i = 0; i < threads; i++)
+		DIE(pthread_create(&workers[i].thread, NULL, (void *(*)(void *))workload->run, &workers[i]),
+			"pthread_create");
+
+	struct timespec pause = { duration_ns / 1000000000UL, duration_ns % 1000000000UL };
+
+	while (nanosleep(&pause, &pause))
+		;
+	__atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+
+	uint64_t calls = 0;
+
+	for (int i = 0; i < threads; i++) {
+		pthread_join(workers[i].thread, NULL);
+		calls += workers[i].calls;
+	}
+
+	uint64_t elapsed = now_ns() - start;
+
+	return (struct result) {
+		.calls_per_sec = calls * 1e9 / elapsed,
+		.peak_rss_kb = proc_status_kb("VmHWM:"),
+	};
+}
+
+// This function runs a workload in a new process, so that the heap and the peak RSS of each
+// run start from scratch
+struct result run_in_child(const struct workload *workload, int threads, uint64_t duration_ns)
+{
+	struct result result;
+	int fds[2];
+
+	DIE(pipe(fds) < 0, "pipe");
+
+	pid_t pid = fork();
+
+	DIE(pid < 0, "fork");
+	if (pid == 0) {
+		close(fds[0]);
+		result = run_workload(workload, threads, duration_ns);
+		if (write(fds[1], &result, sizeof(result)) != sizeof(result))
+			_exit(EXIT_FAILURE);
+		_exit(EXIT_SUCCESS);
+	}
+
+	close(fds[1]);
+
+	int status;
+	ssize_t len = read(fds[0], &result, sizeof(result));
+
+	close(fds[0]);
+	DIE(waitpid(pid, &status, 0) < 0, "waitpid");
+	if (len != sizeof(result) || !WIFEXITED(status) || WEXITSTATUS(status)) {
+		fprintf(stderr, "%s with %d threads failed\n", workload->name, threads);
+		exit(EXIT_FAILURE);
+	}
+
+	return result;
+}
+
+// This function returns the next number of threads to run with: 1, 2, 4... and the maximum
+long next_threads(long threads, long max_threads)
+{
+	return threads * 2 > max_threads && threads != max_threads ? max_threads : threads * 2;
+}
+
+void usage(const char *name)
+{
+	fprintf(stderr, "usage: %s [-s] [-t threads] [-d seconds] [workload...]\n", name);
+	fprintf(stderr, "  -s  run against the allocator of libc instead of libosmem.so\n");
+	fprintf(stderr, "  -t  maximum number of threads (the number of CPUs by default)\n");
+	fprintf(stderr, "  -d  duration of every run (1 second by default)\n");
+	fprintf(stderr, "workloads:");
+	for (size_t i = 0; i < N_WORKLOADS; i++)
+		fprintf(stderr, " %s", workloads[i].name);
+	fprintf(stderr, "\n");
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+	long max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	double duration = 1;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "st:d:")) != -1) {
+		switch (opt) {
+		case 's':
+			alloc = &libc;
+			break;
+		case 't':
+			max_threads = strtol(optarg, NULL, 0);
+			break;
+		case 'd':
+			duration = strtod(optarg, NULL);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (max_threads < 1 || max_threads > MAX_THREADS || duration <= 0)
+		usage(argv[0]);
+
+	int selected[N_WORKLOADS] = { 0 };
+
+	for (int i = optind; i < argc; i++) {
+		size_t idx = 0;
+
+		while (idx < N_WORKLOADS && strcmp(argv[i], workloads[idx].name))
+			idx++;
+		if (idx == N_WORKLOADS)
+			usage(argv[0]);
+		selected[idx] = 1;
+	}
+
+	printf("allocator: %s, up to %ld threads, %.1f s per run\n", alloc->name, max_threads, duration);
+	printf("%-14s %7s %14s %8s %12s\n", "workload", "threads", "calls/s", "speedup", "peak RSS");
+
+	for (size_t idx = 0; idx < N_WORKLOADS; idx++) {
+		if (optind < argc && !selected[idx])
+			continue;
+
+		double single = 0;
+
+		for (long threads = 1; threads <= max_threads; threads = next_threads(threads, max_threads)) {
+			struct result result = run_in_child(&workloads[idx], threads, duration * 1e9);
+
+			if (threads == 1)
+				single = result.calls_per_sec;
+			printf("%-14s %7ld %14.0f %8.2f %8zu KiB\n", workloads[idx].name, threads,
+				   result.calls_per_sec, result.calls_per_sec / single, result.peak_rss_kb);
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,272 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+// Allocation trace recorder, preloaded in a program with LD_PRELOAD=./trace.so.
+// Every malloc(), calloc(), realloc(), free() and aligned allocation of the program is
+// written to the file named by OSMEM_TRACE (osmem-<pid>.trace by default), one per line:
+//
+//	m <ptr> <size>
+//	c <ptr> <nmemb> <size>
+//	r <ptr> <old ptr> <size>
+//	a <ptr> <alignment> <size>
+//	f <ptr>
+//
+// Pointers and sizes are in hexadecimal. A free is written before the block is given back,
+// and an allocation after it is made, so a freed pointer that is handed out again shows up
+// in the right order even when the calls come from several threads (realloc() moving a
+// block is the exception, replay copes with it). The trace is replayed by replay.
+
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+#include <unistd.h>
+
+#define TRACE_BUF_SIZE (64 * 1024)
+#define BOOTSTRAP_SIZE (16 * 1024)
+
+static void *(*real_malloc)(size_t);
+static void (*real_free)(void *);
+static void *(*real_calloc)(size_t, size_t);
+static void *(*real_realloc)(void *, size_t);
+static void *(*real_memalign)(size_t, size_t);
+static int (*real_posix_memalign)(void **, size_t, size_t);
+static void *(*real_aligned_alloc)(size_t, size_t);
+
+// dlsym() may allocate before the real functions are known, those requests are served from here
+static char bootstrap[BOOTSTRAP_SIZE] __attribute__((aligned(16)));
+static size_t bootstrap_used;
+
+static pthread_mutex_t trace_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int trace_fd = -1;
+static char trace_buf[TRACE_BUF_SIZE];
+static size_t trace_len;
+
+// Set while a thread is inside the recorder, the allocations it makes are not traced
+static __thread int in_trace __attribute__((tls_model("initial-exec")));
+
+void trace_flush(void)
+{
+	size_t done = 0;
+
+	while (done < trace_len) {
+		ssize_t ret = write(trace_fd, trace_buf + done, trace_len - done);
+
+		if (ret < 0 && errno == EINTR)
+			continue;
+		// The trace is lost, but the program goes on
+		if (ret <= 0)
+			break;
+		done += ret;
+	}
+	trace_len = 0;
+}
+
+void trace_open(void)
+{
+	char name[64] = "osmem-";
+	char *path = getenv("OSMEM_TRACE");
+
+	if (!path || !*path) {
+		// The pid is formatted by hand, snprintf() may allocate
+		char digits[16];
+		int len = 0;
+
+		for (pid_t pid = getpid(); pid; pid /= 10)
+			digits[len++] = '0' + pid % 10;
+		for (size_t pos = strlen(name); len; pos++)
+			name[pos] = digits[--len];
+		strcat(name, ".trace");
+		path = name;
+	}
+
+	trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+}
+
+void trace_hex(unsigned long value)
+{
+	char digits[16];
+	int len = 0;
+
+	do {
+		digits[len++] = "0123456789abcdef"[value % 16];
+		value /= 16;
+	} while (value);
+
+	trace_buf[trace_len++] = ' ';
+	while (len)
+		trace_buf[trace_len++] = digits[--len];
+}
+
+// This function writes a trace line with up to three values
+void trace_record(char op, int count, unsigned long a, unsigned long b, unsigned long c)
+{
+	if (in_trace)
+		return;
+	in_trace = 1;
+
+	pthread_mutex_lock(&trace_mutex);
+	if (trace_fd == -1)
+		trace_open();
+
+	if (trace_fd != -1) {
+		// Room for the longest line
+		if (trace_len > TRACE_BUF_SIZE - 64)
+			trace_flush();
+
+		trace_buf[trace_len++] = op;
+		trace_hex(a);
+		if (count > 1)
+			trace_hex(b);
+		if (count > 2)
+			trace_hex(c);
+		trace_buf[trace_len++] = '\n';
+	}
+	pthread_mutex_unlock(&trace_mutex);
+
+	in_trace = 0;
+}
+
+void *bootstrap_alloc(size_t size)
+{
+	void *ptr = bootstrap + bootstrap_used;
+
+	size = (size + 15) & ~15UL;
+	if (size > BOOTSTRAP_SIZE - bootstrap_used)
+		return NULL;
+	bootstrap_used += size;
+
+	return memset(ptr, 0, size);
+}
+
+int is_bootstrap(void *ptr)
+{
+	return (char *)ptr >= bootstrap && (char *)ptr < bootstrap + BOOTSTRAP_SIZE;
+}
+
+__attribute__((constructor))
+void trace_init(void)
+{
+	static int resolving;
+
+	if (real_malloc || resolving)
+		return;
+	resolving = 1;
+
+	real_calloc = dlsym(RTLD_NEXT, "calloc");
+	real_malloc = dlsym(RTLD_NEXT, "malloc");
+	real_free = dlsym(RTLD_NEXT, "free");
+	real_realloc = dlsym(RTLD_NEXT, "realloc");
+	real_memalign = dlsym(RTLD_NEXT, "memalign");
+	real_posix_memalign = dlsym(RTLD_NEXT, "posix_memalign");
+	real_aligned_alloc = dlsym(RTLD_NEXT, "aligned_alloc");
+}
+
+__attribute__((destructor))
+void trace_fini(void)
+{
+	pthread_mutex_lock(&trace_mutex);
+	if (trace_fd != -1)
+		trace_flush();
+	pthread_mutex_unlock(&trace_mutex);
+}
+
+void *malloc(size_t size)
+{
+	trace_init();
+	if (!real_malloc)
+		return bootstrap_alloc(size);
+
+	void *ptr = real_malloc(size);
+
+	if (ptr)
+		trace_record('m', 2, (unsigned long)ptr, size, 0);
+
+	return ptr;
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	trace_init();
+	if (!real_calloc)
+		return bootstrap_alloc(nmemb * size);
+
+	void *ptr = real_calloc(nmemb, size);
+
+	if (ptr)
+		trace_record('c', 3, (unsigned long)ptr, nmemb, size);
+
+	return ptr;
+}
+
+void free(void *ptr)
+{
+	if (!ptr || is_bootstrap(ptr))
+		return;
+
+	trace_init();
+
+	trace_record('f', 1, (unsigned long)ptr, 0, 0);
+	real_free(ptr);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	trace_init();
+
+	// A bootstrap block is moved to the real heap, as a new allocation
+	if (is_bootstrap(ptr)) {
+		void *new_ptr = malloc(size);
+
+		if (new_ptr)
+			memcpy(new_ptr, ptr, MIN(size, (size_t)(bootstrap + BOOTSTRAP_SIZE - (char *)ptr)));
+		return new_ptr;
+	}
+
+	void *new_ptr = real_realloc(ptr, size);
+
+	// A failed realloc() leaves the block as it was
+	if (new_ptr || size == 0)
+		trace_record('r', 3, (unsigned long)new_ptr, (unsigned long)ptr, size);
+
+	return new_ptr;
+}
+
+void *memalign(size_t alignment, size_t size)
+{
+	trace_init();
+
+	void *ptr = real_memalign(alignment, size);
+
+	if (ptr)
+		trace_record('a', 3, (unsigned long)ptr, alignment, size);
+
+	return ptr;
+}
+
+void *aligned_alloc(size_t alignment, size_t size)
+{
+	trace_init();
+
+	void *ptr = real_aligned_alloc(alignment, size);
+
+	if (ptr)
+		trace_record('a', 3, (unsigned long)ptr, alignment, size);
+
+	return ptr;
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+	trace_init();
+
+	int ret = real_posix_memalign(memptr, alignment, size);
+
+	if (!ret)
+		trace_record('a', 3, (unsigned long)*memptr, alignment, size);
+
+	return ret;
+}
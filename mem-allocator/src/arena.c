@@ -0,0 +1,441 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <linux/mempolicy.h>
+#include <sys/syscall.h>
+#ifdef OSMEM_THREAD_SAFE
+#include <sched.h>
+#endif
+
+#include "heap.h"
+
+#ifdef OSMEM_THREAD_SAFE
+// The first arena is always the main one, the others are created on first use
+static struct arena *arenas[MAX_ARENAS] = { &main_arena };
+static unsigned long next_arena;
+
+static pthread_mutex_t arenas_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread struct arena *my_arena __attribute__((tls_model("initial-exec")));
+#endif
+
+// This function reserves size bytes of address space aligned to alignment (a power of two),
+// it returns NULL if there is no address space left
+void *reserve_region(size_t size, size_t alignment)
+{
+	void *region = mmap(NULL, size + alignment, PROT_READ | PROT_WRITE,
+						MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+	if (region == MAP_FAILED)
+		return NULL;
+
+	void *start = (void *)(((unsigned long)region + alignment - 1) & ~(alignment - 1));
+	void *end = start + size;
+
+	// Give back the unaligned ends of the reservation
+	if (start != region)
+		DIE(munmap(region, start - region) == -1, "arena munmap syscall failed\n");
+	if (end != region + size + alignment)
+		DIE(munmap(end, region + size + alignment - end) == -1, "arena munmap syscall failed\n");
+
+	return start;
+}
+
+// This function returns the granularity in which free heap pages are given back to the OS
+size_t heap_page_size(void)
+{
+	return config.huge_pages ? HUGE_PAGE_SIZE : (size_t)getpagesize();
+}
+
+// This function asks for transparent huge pages on a range of memory if OSMEM_HUGEPAGES is set
+void advise_huge_pages(void *start, size_t len)
+{
+	if (!config.huge_pages || len < HUGE_PAGE_SIZE)
+		return;
+
+	// Without transparent huge page support, the memory simply stays on normal pages
+	if (madvise(start, len, MADV_HUGEPAGE) == 0)
+		stat_add(madvise_calls, 1);
+}
+
+// This function returns the number of NUMA nodes of the machine, 1 if it cannot be found
+int numa_node_count(void)
+{
+	char buf[64];
+	int fd = open("/sys/devices/system/node/possible", O_RDONLY);
+
+	if (fd < 0)
+		return 1;
+
+	ssize_t len = read(fd, buf, sizeof(buf) - 1);
+
+	close(fd);
+	if (len <= 0)
+		return 1;
+	buf[len] = '\0';
+
+	// The list ends with the highest node ("0", "0-1", "0,2-3")
+	char *last = buf + strcspn(buf, "\n");
+
+	while (last > buf && last[-1] >= '0' && last[-1] <= '9')
+		last--;
+
+	return atoi(last) + 1;
+}
+
+// This function makes the pages of a region come from a NUMA node, for the arenas of
+// OSMEM_ARENA_POLICY=numa. The node is preferred, not required: once it has no free memory
+// left, the pages come from the other nodes.
+void numa_bind(void *start, size_t len, int node)
+{
+	unsigned long mask;
+
+	if (node >= MAX_NUMA_NODES)
+		return;
+
+	mask = 1UL << node;
+
+	// Without NUMA support, the pages simply come from the node of the thread that touches them.
+	// The kernel reads one bit less than the number of nodes it is given.
+	syscall(SYS_mbind, start, len, MPOL_PREFERRED, &mask, MAX_NUMA_NODES + 1, 0);
+}
+
+// This function sets up a region aligned to a huge page for the heap of the main arena. It is also
+// used with the compact headers, whose heap must not have holes left by other users of brk, and
+// with the NUMA arenas, the main arena being the arena of node 0.
+void huge_heap_init(struct arena *arena)
+{
+	void *start = reserve_region(HUGE_HEAP_SIZE, HUGE_PAGE_SIZE);
+
+	DIE(!start, "arena mmap syscall failed\n");
+	advise_huge_pages(start, HUGE_HEAP_SIZE);
+	if (config.arena_per_node)
+		numa_bind(start, HUGE_HEAP_SIZE, 0);
+
+	arena->heap_start = start;
+	arena->heap_end = start;
+	arena->heap_limit = start + HUGE_HEAP_SIZE;
+	arena->heap_committed = start;
+}
+
+// This function backs the heap of an arena with hugetlb pages up to end, a huge page at a time.
+// The pages are mapped elsewhere and moved over the reservation, so that if the pool of huge pages
+// is empty the heap stays on the transparent huge pages of the reservation.
+void heap_commit(struct arena *arena, void *end)
+{
+	if (config.huge_pages != HUGEPAGES_HUGETLB || end <= arena->heap_committed)
+		return;
+
+	void *new_committed = (void *)(((unsigned long)end + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1));
+	size_t len = new_committed - arena->heap_committed;
+	void *pages = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+
+	if (pages != MAP_FAILED) {
+		stat_add(mmap_calls, 1);
+		DIE(mremap(pages, len, len, MREMAP_MAYMOVE | MREMAP_FIXED, arena->heap_committed) == MAP_FAILED,
+			"arena mremap syscall failed\n");
+		stat_add(mremap_calls, 1);
+	}
+
+	arena->heap_committed = new_committed;
+}
+
+// This function grows the heap of an arena by increment bytes and returns the old end of the heap,
+// or MAP_FAILED if there is no memory left
+void *heap_grow(struct arena *arena, size_t increment)
+{
+	void *old_end;
+
+	if (!arena->heap_start && (config.huge_pages || COMPACT_HEADERS || config.arena_per_node))
+		huge_heap_init(arena);
+
+	// The free list links cannot address a bigger heap
+	if (increment > HEAP_LINK_LIMIT - (size_t)(arena->heap_end - arena->heap_start))
+		return MAP_FAILED;
+
+	if (arena->heap_limit) {
+		if (increment > (size_t)(arena->heap_limit - arena->heap_end))
+			return MAP_FAILED;
+		old_end = arena->heap_end;
+		heap_commit(arena, old_end + increment);
+	} else {
+		old_end = sbrk(increment);
+		if (old_end == MAP_FAILED)
+			return MAP_FAILED;
+		stat_add(sbrk_calls, 1);
+		stat_add(sbrk_bytes, increment);
+		if (!arena->heap_start)
+			arena->heap_start = old_end;
+	}
+
+	// heap_end of the main arena is read without its lock by arena_of()
+	__atomic_store_n(&arena->heap_end, old_end + increment, __ATOMIC_RELEASE);
+
+	return old_end;
+}
+
+// This function gives the last decrement bytes of the heap of an arena back to the OS,
+// returns -1 if the heap cannot shrink
+int heap_shrink(struct arena *arena, size_t decrement)
+{
+	void *new_end = arena->heap_end - decrement;
+
+	if (arena->heap_limit) {
+		// hugetlb pages can only be given back whole, the heap does not use the end of the last one
+		if (config.huge_pages == HUGEPAGES_HUGETLB)
+			decrement = (((unsigned long)arena->heap_end + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1)) -
+						(unsigned long)new_end;
+		DIE(madvise(new_end, decrement, MADV_DONTNEED) == -1, "trim madvise syscall failed\n");
+		stat_add(madvise_calls, 1);
+	} else {
+		// The program break was moved by someone else
+		if (sbrk(0) != arena->heap_end)
+			return -1;
+
+		DIE(sbrk(-(intptr_t)decrement) == MAP_FAILED, "trim sbrk syscall failed\n");
+		stat_add(sbrk_calls, 1);
+	}
+
+	stat_add(trimmed_bytes, arena->heap_end - new_end);
+
+	// The pages given back read as zeros when the heap grows again
+	if (arena->fresh_start > new_end)
+		arena->fresh_start = new_end;
+
+	__atomic_store_n(&arena->heap_end, new_end, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+#ifdef OSMEM_THREAD_SAFE
+// This function returns the arena of the CPU the thread runs on (OSMEM_ARENA_POLICY=cpu), or of
+// its NUMA node (OSMEM_ARENA_POLICY=numa): each node gets its share of the arenas, in which the
+// threads are spread by CPU
+int cpu_arena_index(void)
+{
+	unsigned int cpu, node;
+
+	if (getcpu(&cpu, &node) < 0)
+		return 0;
+
+	if (!config.arena_per_node)
+		return cpu % config.arenas;
+
+	int per_node = config.arenas / config.numa_nodes;
+
+	if (per_node == 0)
+		per_node = 1;
+
+	return (node * per_node + cpu % per_node) % config.arenas;
+}
+
+// This function reserves an ARENA_SIZE region aligned to its size for a new arena,
+// so that the arena of a block can be found by masking its address
+struct arena *create_arena(int idx)
+{
+	void *start = reserve_region(ARENA_SIZE, ARENA_SIZE);
+
+	DIE(!start, "arena mmap syscall failed\n");
+	int per_node = config.arenas / config.numa_nodes;
+	int node = per_node ? idx / per_node : idx;
+
+	advise_huge_pages(start, ARENA_SIZE);
+	// Before the arena is written to, its page must come from the node too
+	if (config.arena_per_node)
+		numa_bind(start, ARENA_SIZE, node);
+
+	// The arena lives at the start of its region, the heap follows it
+	struct arena *arena = start;
+
+	arena->heap_start = start + sizeof(struct arena) + padding(sizeof(struct arena));
+	arena->heap_end = arena->heap_start;
+	arena->heap_limit = start + ARENA_SIZE;
+	// The first huge page holds the arena, it is never replaced by hugetlb pages
+	arena->heap_committed = start + HUGE_PAGE_SIZE;
+	arena->node = node;
+	pthread_mutex_init(&arena->lock, NULL);
+
+	return arena;
+}
+
+// This function returns the arena with the given index, creating it if needed
+struct arena *get_arena(int idx)
+{
+	struct arena *arena = __atomic_load_n(&arenas[idx], __ATOMIC_ACQUIRE);
+
+	if (arena)
+		return arena;
+
+	pthread_mutex_lock(&arenas_mutex);
+	arena = arenas[idx];
+	if (!arena) {
+		arena = create_arena(idx);
+		__atomic_store_n(&arenas[idx], arena, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&arenas_mutex);
+
+	return arena;
+}
+
+// This function returns the arena with the given index, or NULL if it was never used
+struct arena *created_arena(int idx)
+{
+	return __atomic_load_n(&arenas[idx], __ATOMIC_ACQUIRE);
+}
+
+// This function returns the arena the current thread allocates from
+struct arena *thread_arena(void)
+{
+	if (config.arenas == 1)
+		return &main_arena;
+
+	// Pick the arena from the CPU the thread runs on instead of assigning one per thread
+	if (config.arena_per_cpu || config.arena_per_node)
+		return get_arena(cpu_arena_index());
+
+	// Threads are spread over the arenas in the order of their first allocation
+	if (!my_arena) {
+		my_arena = get_arena(__atomic_fetch_add(&next_arena, 1, __ATOMIC_RELAXED) % config.arenas);
+		__atomic_fetch_add(&my_arena->threads, 1, __ATOMIC_RELAXED);
+	}
+
+	return my_arena;
+}
+
+// This function returns the arena a heap block belongs to
+struct arena *arena_of(struct block_meta *block)
+{
+	void *addr = block;
+
+	if (config.arenas == 1)
+		return &main_arena;
+
+	if (addr >= main_arena.heap_start && addr < __atomic_load_n(&main_arena.heap_end, __ATOMIC_ACQUIRE))
+		return &main_arena;
+
+	return (struct arena *)((unsigned long)addr & ~(ARENA_SIZE - 1));
+}
+
+// This function returns 1 if the current thread allocates from an arena
+int arena_is_local(struct arena *arena)
+{
+	if (config.arenas == 1)
+		return 1;
+
+	if (config.arena_per_cpu || config.arena_per_node)
+		return arena == created_arena(cpu_arena_index());
+
+	return arena == my_arena;
+}
+
+void heap_lock(struct arena *arena)
+{
+	int busy = pthread_mutex_trylock(&arena->lock);
+
+	if (busy)
+		pthread_mutex_lock(&arena->lock);
+
+	arena->locks++;
+	if (busy)
+		arena->lock_contentions++;
+}
+
+void heap_unlock(struct arena *arena)
+{
+	pthread_mutex_unlock(&arena->lock);
+}
+
+// No arena is created while arenas_mutex is held, the locks of all of them are taken
+void arena_fork(int stage)
+{
+	fork_mutex(&arenas_mutex, stage);
+	for (int idx = 0; idx < MAX_ARENAS; idx++) {
+		if (arenas[idx])
+			fork_mutex(&arenas[idx]->lock, stage);
+	}
+}
+
+int os_arena_count(void)
+{
+	return config.arenas;
+}
+#else
+struct arena *get_arena(int idx)
+{
+	return idx == 0 ? &main_arena : NULL;
+}
+
+struct arena *created_arena(int idx)
+{
+	return get_arena(idx);
+}
+
+struct arena *thread_arena(void)
+{
+	return &main_arena;
+}
+
+struct arena *arena_of(struct block_meta *block)
+{
+	(void)block;
+
+	return &main_arena;
+}
+
+int os_arena_count(void)
+{
+	return 1;
+}
+#endif
+
+// This function returns 1 if ptr is on the heap of an arena
+int heap_owns(void *ptr)
+{
+	for (int idx = 0; idx < os_arena_count(); idx++) {
+		struct arena *arena = created_arena(idx);
+
+		if (arena && ptr >= arena->heap_start && ptr < __atomic_load_n(&arena->heap_end, __ATOMIC_ACQUIRE))
+			return 1;
+	}
+
+	return 0;
+}
+
+// This function fills in the statistics of an arena, returns -1 if there is no such arena
+int os_arena_stats(int idx, struct os_arena_stats *stats)
+{
+	if (idx < 0 || idx >= os_arena_count() || !stats)
+		return -1;
+
+	memset(stats, 0, sizeof(*stats));
+	stats->node = -1;
+
+	// Arenas that were never used have not been created yet
+	struct arena *arena = created_arena(idx);
+
+	if (!arena)
+		return 0;
+
+	heap_lock(arena);
+	// The queued blocks and the block os_realloc() moved away from are counted as free
+	heap_settle(arena);
+	stats->heap_size = arena->heap_end - arena->heap_start;
+	for (struct block_meta *block = arena->list_head; block; block = next_block(arena, block)) {
+		if (block->status == STATUS_FREE) {
+			stats->free_bytes += block->size;
+			stats->free_blocks++;
+		} else {
+			stats->alloc_bytes += block->size;
+			stats->alloc_blocks++;
+		}
+	}
+	stats->threads = arena->threads;
+	stats->locks = arena->locks;
+	stats->lock_contentions = arena->lock_contentions;
+	stats->remote_frees = arena->remote_frees;
+	stats->node = config.arena_per_node ? arena->node : -1;
+	heap_unlock(arena);
+
+	return 0;
+}
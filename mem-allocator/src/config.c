@@ -0,0 +1,130 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "heap.h"
+
+// Largest threshold the dynamic threshold can reach, bigger blocks are always mapped
+#define DYNAMIC_THRESHOLD_MAX (32 * 1024 * 1024)
+// Bytes of freed blocks kept in quarantine by the hardened mode (OSMEM_DEBUG=2)
+#define QUARANTINE_SIZE (256 * 1024)
+
+struct osmem_config config = {
+	.mmap_threshold = MMAP_THRESHOLD,
+	.prealloc_size = MMAP_THRESHOLD,
+	.arenas = 1,
+	.numa_nodes = 1,
+};
+
+// This function reads a size from the environment, returns 0 if the variable is not set
+int env_size(const char *name, size_t *value)
+{
+	char *env = getenv(name);
+	char *end;
+
+	if (!env || !*env)
+		return 0;
+
+	size_t size = strtoul(env, &end, 0);
+
+	if (*end)
+		return 0;
+
+	*value = size;
+	return 1;
+}
+
+int env_flag(const char *name)
+{
+	char *env = getenv(name);
+
+	return env && atoi(env) == 1;
+}
+
+// This function reads the allocator configuration from the environment when the library is loaded
+__attribute__((constructor))
+void config_init(void)
+{
+	size_t value;
+
+	// os_calloc() maps everything from a page up, unless a threshold is set
+	config.calloc_threshold = getpagesize();
+	if (env_size("OSMEM_MMAP_THRESHOLD", &value)) {
+		config.mmap_threshold = value;
+		config.calloc_threshold = value;
+	}
+	env_size("OSMEM_CALLOC_THRESHOLD", &config.calloc_threshold);
+
+	if (env_size("OSMEM_PREALLOC", &value)) {
+		value += padding(value);
+		// The preallocated block must fit a header and a payload
+		if (value >= META_SIZE + padding(META_SIZE) + 8)
+			config.prealloc_size = value;
+	}
+
+	// Trimming is disabled unless a threshold is set
+	env_size("OSMEM_TRIM_THRESHOLD", &config.trim_threshold);
+
+	config.dynamic_threshold = env_flag("OSMEM_DYNAMIC_THRESHOLD");
+	config.mremap = env_flag("OSMEM_MREMAP");
+	config.slab = env_flag("OSMEM_SLAB");
+	config.stats = env_flag("OSMEM_STATS");
+
+	// The slabs have no headers to check, the hardened mode does without them
+	if (env_size("OSMEM_DEBUG", &value) && value) {
+		config.debug = value > DEBUG_QUARANTINE ? DEBUG_QUARANTINE : value;
+		config.slab = 0;
+		debug_init();
+	}
+
+	if (config.debug == DEBUG_QUARANTINE) {
+		config.quarantine_size = QUARANTINE_SIZE;
+		env_size("OSMEM_QUARANTINE", &config.quarantine_size);
+	}
+
+	if (env_size("OSMEM_PROFILE", &config.profile_interval) && config.profile_interval)
+		profile_init();
+
+	char *huge_pages = getenv("OSMEM_HUGEPAGES");
+
+	if (huge_pages && !strcmp(huge_pages, "thp"))
+		config.huge_pages = HUGEPAGES_THP;
+	else if (huge_pages && !strcmp(huge_pages, "hugetlb"))
+		config.huge_pages = HUGEPAGES_HUGETLB;
+
+	// The heap starts with a whole huge page, unless a preallocation size is set
+	if (config.huge_pages && !getenv("OSMEM_PREALLOC"))
+		config.prealloc_size = HUGE_PAGE_SIZE;
+
+#ifdef OSMEM_THREAD_SAFE
+	char *policy = getenv("OSMEM_ARENA_POLICY");
+
+	config.arena_per_cpu = policy && !strcmp(policy, "cpu");
+	config.arena_per_node = policy && !strcmp(policy, "numa");
+
+	// The NUMA policy gets one arena per node, unless the number of arenas is set
+	if (config.arena_per_node) {
+		config.numa_nodes = numa_node_count();
+		config.arenas = config.numa_nodes > MAX_ARENAS ? MAX_ARENAS : config.numa_nodes;
+	}
+
+	if (env_size("OSMEM_ARENAS", &value))
+		config.arenas = value < 1 ? 1 : value > MAX_ARENAS ? MAX_ARENAS : value;
+
+	fork_init();
+#endif
+}
+
+size_t mmap_threshold(void)
+{
+	return __atomic_load_n(&config.mmap_threshold, __ATOMIC_RELAXED);
+}
+
+// This function raises the threshold above the size of a freed mapped block (header included),
+// so that a program that keeps allocating and freeing blocks of that size gets them from the heap
+void update_mmap_threshold(size_t size)
+{
+	if (!config.dynamic_threshold || size > DYNAMIC_THRESHOLD_MAX)
+		return;
+
+	if (size >= mmap_threshold())
+		__atomic_store_n(&config.mmap_threshold, size + 1, __ATOMIC_RELAXED);
+}
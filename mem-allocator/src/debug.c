@@ -0,0 +1,306 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+// Hardened mode, enabled with OSMEM_DEBUG=1. Every block gets a canary right after the
+// requested bytes and a checksum of its header, stored in the next_freed field that
+// allocated blocks do not use. With OSMEM_DEBUG=2, freed blocks are also poisoned and kept
+// in a quarantine for a while before they go back to their arena, so that writes after free
+// are caught when they leave it. A violation is reported with the caller of the allocator
+// and aborts the program.
+
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <sys/random.h>
+
+#include "heap.h"
+
+#define CANARY_SIZE sizeof(unsigned long)
+#define FREE_POISON 0xdf
+// Number of bytes poisoned when a block is freed, the rest of a bigger block is left as it is
+#define POISON_MAX 4096
+// Number of poisoned bytes checked when a block leaves the quarantine
+#define POISON_CHECK 256
+#define QUARANTINE_SLOTS 4096
+
+// Layout of next_freed for the blocks handed out in debug mode: the header checksum, a flag
+// for the blocks in quarantine and the number of bytes between the canary and the end of the block
+#define SEAL_QUARANTINED (1U << 15)
+#define SEAL_SLACK_MAX (SEAL_QUARANTINED - 1)
+
+static unsigned long secret;
+
+// Freed blocks, oldest first
+static void *quarantine[QUARANTINE_SLOTS];
+static size_t quarantine_head;
+static size_t quarantine_count;
+static size_t quarantine_bytes;
+
+#ifdef OSMEM_THREAD_SAFE
+static pthread_mutex_t quarantine_mutex = PTHREAD_MUTEX_INITIALIZER;
+#define quarantine_lock()	pthread_mutex_lock(&quarantine_mutex)
+#define quarantine_unlock()	pthread_mutex_unlock(&quarantine_mutex)
+
+void quarantine_fork(int stage)
+{
+	fork_mutex(&quarantine_mutex, stage);
+}
+#else
+#define quarantine_lock()	do {} while (0)
+#define quarantine_unlock()	do {} while (0)
+#endif
+
+// This function picks the secret the checksums and canaries are derived from
+void debug_init(void)
+{
+	if (getrandom(&secret, sizeof(secret), GRND_NONBLOCK) != sizeof(secret))
+		secret = (unsigned long)&secret ^ ((unsigned long)getpid() << 32);
+}
+
+struct block_meta *block_of(void *ptr)
+{
+	return ptr - META_SIZE - padding(META_SIZE);
+}
+
+unsigned int header_checksum(struct block_meta *block, unsigned int seal)
+{
+	unsigned long hash = ((unsigned long)block ^ secret) * 0x9e3779b97f4a7c15UL;
+
+	hash ^= (block->size + ((unsigned long)block->status << 48) + (seal & 0xffff)) * 0xc2b2ae3d27d4eb4fUL;
+	hash ^= hash >> 29;
+
+	return (hash >> 32) & 0xffff;
+}
+
+unsigned long canary_value(void *ptr)
+{
+	return ((unsigned long)ptr * 0xff51afd7ed558ccdUL) ^ secret;
+}
+
+// This function reports a violation with the call site and aborts the program
+void debug_report(const char *what, void *ptr, void *caller)
+{
+	struct stats_out out = { .fd = STDERR_FILENO };
+	Dl_info info;
+
+	fctprintf(stats_putchar, &out, "osmem: %s, block 0x%lx, found by a call from 0x%lx", what,
+			  (unsigned long)ptr, (unsigned long)caller);
+	if (caller && dladdr(caller, &info) && info.dli_fname) {
+		if (info.dli_sname)
+			fctprintf(stats_putchar, &out, " (%s+0x%lx in %s)", info.dli_sname,
+					  (unsigned long)(caller - info.dli_saddr), info.dli_fname);
+		else
+			fctprintf(stats_putchar, &out, " (%s+0x%lx)", info.dli_fname,
+					  (unsigned long)(caller - info.dli_fbase));
+	}
+	fctprintf(stats_putchar, &out, "\n");
+	stats_flush(&out);
+
+	abort();
+}
+
+// This function writes the canary after the size requested bytes and seals the header
+void *debug_seal(void *ptr, size_t size)
+{
+	if (!ptr)
+		return NULL;
+
+	struct block_meta *block = block_of(ptr);
+	unsigned long canary = canary_value(ptr);
+	size_t slack = block->size - size - CANARY_SIZE;
+
+	memcpy(ptr + size, &canary, CANARY_SIZE);
+
+	// A block never has that much room left after splitting, the canary is then not checked
+	if (slack > SEAL_SLACK_MAX)
+		slack = SEAL_SLACK_MAX;
+
+	block->next_freed = slack;
+	block->next_freed |= header_checksum(block, block->next_freed) << 16;
+
+	return ptr;
+}
+
+// This function checks the header and the canary of a block given back by the program,
+// and returns the size that was requested for it
+size_t debug_check(void *ptr, void *caller)
+{
+	struct block_meta *block = block_of(ptr);
+
+	// The header can only be read on a heap or in a mapping still in use, a mapped block freed
+	// before is unmapped already
+	if (!heap_owns(block) && !mapped_indexed(block))
+		debug_report("double free or invalid pointer", ptr, caller);
+
+	unsigned int seal = block->next_freed;
+
+	if (block->status == STATUS_FREE)
+		debug_report("double free or invalid pointer", ptr, caller);
+	if (block->status != STATUS_ALLOC && block->status != STATUS_MAPPED)
+		debug_report("invalid pointer or corrupted block header", ptr, caller);
+	if (header_checksum(block, seal) != seal >> 16)
+		debug_report("corrupted block header", ptr, caller);
+	if (seal & SEAL_QUARANTINED)
+		debug_report("double free", ptr, caller);
+
+	size_t slack = seal & SEAL_SLACK_MAX;
+	size_t size = block->size - slack - CANARY_SIZE;
+	unsigned long canary;
+
+	memcpy(&canary, ptr + size, CANARY_SIZE);
+	if (slack != SEAL_SLACK_MAX && canary != canary_value(ptr))
+		debug_report("buffer overflow", ptr, caller);
+
+	return size;
+}
+
+// This function checks that a block was not written to while in quarantine and frees it
+void quarantine_release(void *ptr, void *caller)
+{
+	struct block_meta *block = block_of(ptr);
+	size_t check = block->size < POISON_CHECK ? block->size : POISON_CHECK;
+
+	if (header_checksum(block, block->next_freed) != block->next_freed >> 16)
+		debug_report("corrupted header of a freed block", ptr, caller);
+
+	for (size_t i = 0; i < check; i++)
+		if (((unsigned char *)ptr)[i] != FREE_POISON)
+			debug_report("write after free", ptr, caller);
+
+	arena_free(ptr);
+}
+
+// This function takes the oldest block out of the quarantine, the caller holds its lock
+void *quarantine_pop(void)
+{
+	void *ptr = quarantine[quarantine_head];
+
+	quarantine_head = (quarantine_head + 1) % QUARANTINE_SLOTS;
+	quarantine_count--;
+	quarantine_bytes -= block_of(ptr)->size;
+
+	return ptr;
+}
+
+void *debug_malloc(size_t size)
+{
+	if (size == 0)
+		return NULL;
+
+	struct arena *arena = thread_arena();
+
+	heap_lock(arena);
+	void *ptr = heap_malloc(arena, size + CANARY_SIZE);
+
+	heap_unlock(arena);
+
+	return debug_seal(ptr, size);
+}
+
+void *debug_calloc(size_t size)
+{
+	if (size == 0)
+		return NULL;
+
+	struct arena *arena = thread_arena();
+
+	heap_lock(arena);
+	void *ptr = heap_calloc(arena, size + CANARY_SIZE);
+
+	heap_unlock(arena);
+
+	return debug_seal(ptr, size);
+}
+
+void *debug_memalign(size_t alignment, size_t size)
+{
+	if (size == 0)
+		return NULL;
+
+	struct arena *arena = thread_arena();
+
+	heap_lock(arena);
+	void *ptr = heap_memalign(arena, alignment, size + CANARY_SIZE);
+
+	heap_unlock(arena);
+
+	return debug_seal(ptr, size);
+}
+
+void debug_free(void *ptr, void *caller)
+{
+	struct block_meta *block = block_of(ptr);
+
+	debug_check(ptr, caller);
+
+	// Without the quarantine the block is freed right away, so is a mapping, which faults
+	// on any access once freed
+	if (block->status == STATUS_MAPPED || config.debug != DEBUG_QUARANTINE) {
+		arena_free(ptr);
+		return;
+	}
+
+	memset(ptr, FREE_POISON, block->size < POISON_MAX ? block->size : POISON_MAX);
+	block->next_freed = SEAL_QUARANTINED;
+	block->next_freed |= header_checksum(block, block->next_freed) << 16;
+
+	// The oldest block leaves the quarantine to make room
+	quarantine_lock();
+	void *old = quarantine_count == QUARANTINE_SLOTS ? quarantine_pop() : NULL;
+
+	quarantine[(quarantine_head + quarantine_count++) % QUARANTINE_SLOTS] = ptr;
+	quarantine_bytes += block->size;
+	if (!old && quarantine_bytes > config.quarantine_size)
+		old = quarantine_pop();
+	quarantine_unlock();
+
+	// Then as many as needed to get under the size of the quarantine. The blocks are freed
+	// without the quarantine lock, their arenas have their own.
+	while (old) {
+		quarantine_release(old, caller);
+
+		quarantine_lock();
+		old = quarantine_bytes > config.quarantine_size ? quarantine_pop() : NULL;
+		quarantine_unlock();
+	}
+}
+
+void *debug_realloc(void *ptr, size_t size, void *caller)
+{
+	if (!ptr)
+		return debug_malloc(size);
+
+	if (size == 0) {
+		debug_free(ptr, caller);
+		return NULL;
+	}
+
+	size_t old_size = debug_check(ptr, caller);
+
+	// Without the quarantine the block is resized in place when it can be, like in the normal mode
+	if (config.debug != DEBUG_QUARANTINE) {
+		struct arena *arena = mapped_find(ptr) ? thread_arena() : arena_of(block_of(ptr));
+
+		heap_lock(arena);
+		void *new_ptr = heap_realloc(arena, ptr, size + CANARY_SIZE);
+
+		heap_unlock(arena);
+
+		// The old block is kept, sealed again in case its header was changed
+		if (!new_ptr) {
+			debug_seal(ptr, old_size);
+			return NULL;
+		}
+
+		return debug_seal(new_ptr, size);
+	}
+
+	// With it the block always moves, so that the old one goes through the quarantine
+	void *new_ptr = debug_malloc(size);
+
+	if (!new_ptr)
+		return NULL;
+
+	memcpy(new_ptr, ptr, old_size < size ? old_size : size);
+	debug_free(ptr, caller);
+
+	return new_ptr;
+}
@@ -0,0 +1,53 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+// Fork handlers of the thread-safe build. Before fork(), the thread that forks takes every
+// lock of the allocator, so that no other thread is in the middle of an update of a heap, of
+// the slabs or of the index of mapped blocks. The parent then releases them, and the child,
+// where the other threads are gone, sets them up again. The blocks in the thread caches of the
+// other threads are lost to the child.
+
+#include "heap.h"
+
+void fork_mutex(pthread_mutex_t *mutex, int stage)
+{
+	if (stage == FORK_PREPARE)
+		pthread_mutex_lock(mutex);
+	else if (stage == FORK_PARENT)
+		pthread_mutex_unlock(mutex);
+	else
+		pthread_mutex_init(mutex, NULL);
+}
+
+// The locks are taken in the order they nest in the allocator and released in the other order
+void fork_prepare(void)
+{
+	quarantine_fork(FORK_PREPARE);
+	profile_fork(FORK_PREPARE);
+	arena_fork(FORK_PREPARE);
+	slab_fork(FORK_PREPARE);
+	mapped_fork(FORK_PREPARE);
+}
+
+void fork_release(int stage)
+{
+	mapped_fork(stage);
+	slab_fork(stage);
+	arena_fork(stage);
+	profile_fork(stage);
+	quarantine_fork(stage);
+}
+
+void fork_parent(void)
+{
+	fork_release(FORK_PARENT);
+}
+
+void fork_child(void)
+{
+	fork_release(FORK_CHILD);
+}
+
+void fork_init(void)
+{
+	pthread_atfork(fork_prepare, fork_parent, fork_child);
+}
@@ -0,0 +1,316 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+#pragma once
+
+#ifdef OSMEM_THREAD_SAFE
+#include <pthread.h>
+#endif
+
+#include "osmem.h"
+#include "block_meta.h"
+
+#define META_SIZE sizeof(struct block_meta)
+#define MMAP_THRESHOLD (128 * 1024)
+
+/* Neighbours of a block in its heap. With the compact headers (make COMPACT=1), the next block
+ * is found from the size and the previous one from its distance, see block_meta.h.
+ */
+#ifdef OSMEM_COMPACT
+#define COMPACT_HEADERS 1
+#define next_block(arena, block)	((block) == (arena)->list_tail ? NULL : \
+					 (struct block_meta *)((void *)(block) + META_SIZE + (block)->size))
+#define prev_block(block)		((block)->prev_offset ? \
+					 (struct block_meta *)((void *)(block) - (size_t)(block)->prev_offset * 8) : NULL)
+#define set_next_block(block, to)	((void)(block), (void)(to))
+#define set_prev_block(block, to)	((block)->prev_offset = (to) ? ((void *)(block) - (void *)(to)) / 8 : 0)
+#else
+#define COMPACT_HEADERS 0
+#define next_block(arena, block)	((void)(arena), (block)->next)
+#define prev_block(block)		((block)->prev)
+#define set_next_block(block, to)	((block)->next = (to))
+#define set_prev_block(block, to)	((block)->prev = (to))
+#endif
+
+/* Links of a mapped block in the index of mapped blocks, in its header or,
+ * with the compact headers, right before it
+ */
+struct mapped_links {
+	struct block_meta *prev;
+	struct block_meta *next;
+};
+
+#ifdef OSMEM_COMPACT
+#define MAPPED_PREFIX sizeof(struct mapped_links)
+#define mapped_links(block)	((struct mapped_links *)(block) - 1)
+#else
+#define MAPPED_PREFIX 0
+#define mapped_links(block)	((struct mapped_links *)&(block)->prev)
+#endif
+
+/* Free blocks up to SMALL_BIN_MAX bytes get an exact size class (one per 8 bytes),
+ * bigger ones are split in 4 classes for each power of two. Each class is a splay tree ordered
+ * by size and address (see tree.c), linked through the first bytes of the payloads.
+ */
+#define N_SMALL_BINS 128
+#define SMALL_BIN_MAX (N_SMALL_BINS * 8)
+#define N_BINS (N_SMALL_BINS + 4 * (64 - 10))
+#define BIN_MAP_WORDS ((N_BINS + 63) / 64)
+
+/* Free blocks of at least TREE_MIN bytes are kept in a tree instead (see tree.c), TREE_BIN is
+ * their first size class, its bit in the bin map is set when the tree is not empty
+ */
+#define TREE_MIN 4096
+#define TREE_BIN (N_SMALL_BINS + 4 * (12 - 10))
+
+struct tree_node {
+	unsigned int left;
+	unsigned int right;
+	unsigned int parent;
+	unsigned int red;
+};
+
+/* Links of a free block in the splay tree of its size class, they fit in the smallest payload */
+struct free_links {
+	unsigned int left;
+	unsigned int right;
+};
+
+/* The links count 8 byte units from the heap start in 32 bits, a heap cannot grow past this */
+#define HEAP_LINK_LIMIT (32UL << 30)
+
+/* Maximum number of arenas and size of the address range reserved for each extra arena */
+#define MAX_ARENAS 64
+#define ARENA_SIZE (1UL << 30)
+/* Highest NUMA node the arenas can be bound to, plus one */
+#define MAX_NUMA_NODES 64
+
+/* With OSMEM_HUGEPAGES, the main arena grows inside a HUGE_HEAP_SIZE region aligned to a huge page
+ * instead of the brk heap, the free list links can address up to 32 GiB from the heap start
+ */
+#define HUGE_PAGE_SIZE (2UL * 1024 * 1024)
+#define HUGE_HEAP_SIZE (32UL << 30)
+#define HUGEPAGES_THP 1
+#define HUGEPAGES_HUGETLB 2
+
+/* An arena is an independent heap: the main arena grows with sbrk, the extra ones
+ * (thread-safe build only) in an ARENA_SIZE aligned region reserved with mmap
+ */
+struct arena {
+	/* List of the blocks of the heap, in address order */
+	struct block_meta *list_head;
+	struct block_meta *list_tail;
+
+	/* Start and end of the heap, free list links are stored relative to heap_start */
+	void *heap_start;
+	void *heap_end;
+	/* End of the reserved region, NULL for the brk heap */
+	void *heap_limit;
+	/* End of the part of the region backed by hugetlb pages (OSMEM_HUGEPAGES=hugetlb) */
+	void *heap_committed;
+	/* The payloads of the free blocks are zero from here on, as the OS gave them to the heap */
+	void *fresh_start;
+
+	/* Roots of the splay trees of the size classes, ordered by size and then by address */
+	unsigned int bins[N_BINS];
+	unsigned long bin_map[BIN_MAP_WORDS];
+	/* Root of the tree of the big free blocks */
+	unsigned int free_tree;
+	/* Block os_realloc() moved away from, merged but put in its size class by the next call */
+	unsigned int moved_block;
+
+	unsigned long threads;
+	unsigned long locks;
+	unsigned long lock_contentions;
+	unsigned long remote_frees;
+	/* NUMA node the heap is bound to, with OSMEM_ARENA_POLICY=numa */
+	int node;
+#ifdef OSMEM_THREAD_SAFE
+	pthread_mutex_t lock;
+	/* Blocks freed by threads that allocate from other arenas, pushed without the lock */
+	unsigned int remote_freed;
+#endif
+};
+
+extern struct arena main_arena;
+
+/* Allocator settings, read from the environment when the library is loaded (see config.c) */
+struct osmem_config {
+	size_t mmap_threshold;
+	size_t calloc_threshold;
+	size_t prealloc_size;
+	size_t trim_threshold;
+	int dynamic_threshold;
+	int mremap;
+	int slab;
+	int arenas;
+	int arena_per_cpu;
+	int arena_per_node;
+	int numa_nodes;
+	int stats;
+	int huge_pages;
+	int debug;
+	size_t quarantine_size;
+	size_t profile_interval;
+};
+
+extern struct osmem_config config;
+
+size_t mmap_threshold(void);
+void update_mmap_threshold(size_t size);
+
+/* Allocator counters, reported by os_malloc_info() (see stats.c) */
+struct osmem_counters {
+	unsigned long sbrk_calls;
+	unsigned long sbrk_bytes;
+	unsigned long trimmed_bytes;
+	unsigned long mmap_calls;
+	unsigned long mmap_bytes;
+	unsigned long munmap_calls;
+	unsigned long mremap_calls;
+	unsigned long madvise_calls;
+	unsigned long mapped_bytes;
+	unsigned long mapped_blocks;
+	unsigned long slab_bytes;
+	unsigned long splits;
+	unsigned long coalesces;
+	unsigned long slab_hits;
+	unsigned long tcache_hits;
+	/* Requests served from a free block, by the size class of the request */
+	unsigned long class_hits[N_BINS];
+};
+
+extern struct osmem_counters counters;
+
+#ifdef OSMEM_THREAD_SAFE
+#define stat_add(field, n)	__atomic_fetch_add(&counters.field, (n), __ATOMIC_RELAXED)
+#define stat_sub(field, n)	__atomic_fetch_sub(&counters.field, (n), __ATOMIC_RELAXED)
+#else
+#define stat_add(field, n)	(counters.field += (n))
+#define stat_sub(field, n)	(counters.field -= (n))
+#endif
+
+size_t padding(size_t size);
+
+/* Links between the free blocks, offsets from the heap start of their arena */
+unsigned int block_to_link(struct arena *arena, struct block_meta *block);
+struct block_meta *link_to_block(struct arena *arena, unsigned int link);
+void heap_dirty(struct arena *arena, void *end);
+
+struct free_links *get_links(struct block_meta *block);
+void class_insert(struct arena *arena, size_t idx, struct block_meta *block);
+void class_remove(struct arena *arena, size_t idx, struct block_meta *block);
+struct block_meta *class_best_fit(struct arena *arena, size_t idx, size_t size);
+
+void tree_insert(struct arena *arena, struct block_meta *block);
+void tree_remove(struct arena *arena, struct block_meta *block);
+struct block_meta *tree_best_fit(struct arena *arena, size_t size);
+
+/* Allocator paths working on one arena, the caller must hold the arena lock */
+void *heap_malloc(struct arena *arena, size_t size);
+void *heap_calloc(struct arena *arena, size_t size);
+void *heap_realloc(struct arena *arena, void *ptr, size_t size);
+void heap_free(struct arena *arena, void *ptr);
+void heap_settle(struct arena *arena);
+void *heap_memalign(struct arena *arena, size_t alignment, size_t size);
+size_t heap_malloc_batch(struct arena *arena, size_t size, void **ptrs, size_t count);
+
+/* Arena management, see arena.c */
+void *reserve_region(size_t size, size_t alignment);
+void *heap_grow(struct arena *arena, size_t increment);
+int heap_shrink(struct arena *arena, size_t decrement);
+size_t heap_page_size(void);
+void advise_huge_pages(void *start, size_t len);
+int numa_node_count(void);
+void numa_bind(void *start, size_t len, int node);
+struct arena *thread_arena(void);
+struct arena *arena_of(struct block_meta *block);
+struct arena *get_arena(int idx);
+struct arena *created_arena(int idx);
+int heap_owns(void *ptr);
+int mapped_indexed(struct block_meta *block);
+struct block_meta *mapped_find(void *ptr);
+
+/* Headerless allocator for objects of up to SLAB_MAX bytes, see slab.c */
+#define SLAB_MAX 256
+void *slab_malloc(size_t size);
+void slab_free(void *ptr, void *caller);
+void *slab_realloc(void *ptr, size_t size, void *caller);
+size_t slab_size(void *ptr);
+int slab_owns(void *ptr);
+
+/* Output of os_malloc_stats() and of the debug reports, buffered so that printing
+ * does not write one character at a time
+ */
+struct stats_out {
+	int fd;
+	size_t len;
+	char buf[256];
+};
+
+void stats_putchar(char character, void *arg);
+void stats_flush(struct stats_out *out);
+
+/* Hardened mode, see debug.c: OSMEM_DEBUG=1 checks the headers and the canaries,
+ * OSMEM_DEBUG=2 also poisons the freed blocks and keeps them in quarantine
+ */
+#define DEBUG_CHECKS 1
+#define DEBUG_QUARANTINE 2
+void debug_init(void);
+void *debug_malloc(size_t size);
+void *debug_calloc(size_t size);
+void *debug_memalign(size_t alignment, size_t size);
+void *debug_realloc(void *ptr, size_t size, void *caller);
+void debug_free(void *ptr, void *caller);
+size_t debug_check(void *ptr, void *caller);
+void debug_report(const char *what, void *ptr, void *caller);
+
+/* Sampling heap profiler (OSMEM_PROFILE), see profile.c */
+void profile_init(void);
+void profile_malloc(void *ptr, size_t size);
+void profile_free(void *ptr);
+
+/* Emergency reserve, see reserve.c. in_allocator is set while the thread runs an allocator call. */
+extern __thread int in_allocator __attribute__((tls_model("initial-exec")));
+void *reserve_alloc(size_t size);
+int reserve_owns(void *ptr);
+size_t reserve_size(void *ptr);
+
+/* os_malloc() without the profiler and the reserve */
+void *do_malloc(size_t size);
+
+/* os_free() without the thread cache */
+void arena_free(void *ptr);
+
+#ifdef OSMEM_THREAD_SAFE
+void heap_lock(struct arena *arena);
+void heap_unlock(struct arena *arena);
+
+/* Frees from the threads that do not allocate from an arena, queued without its lock */
+int arena_is_local(struct arena *arena);
+void remote_free(struct arena *arena, struct block_meta *block);
+void remote_drain(struct arena *arena);
+
+/* Fork handlers (see fork.c), every module takes (FORK_PREPARE) and releases its locks */
+#define FORK_PREPARE 0
+#define FORK_PARENT 1
+#define FORK_CHILD 2
+void fork_init(void);
+void fork_mutex(pthread_mutex_t *mutex, int stage);
+void arena_fork(int stage);
+void slab_fork(int stage);
+void mapped_fork(int stage);
+void quarantine_fork(int stage);
+void profile_fork(int stage);
+
+/* Per-thread cache of small blocks, returns NULL / 0 when the request is not served from it */
+void *tcache_malloc(size_t size);
+int tcache_free(void *ptr);
+#else
+#define heap_lock(arena)	do {} while (0)
+#define heap_unlock(arena)	do {} while (0)
+#define arena_is_local(arena)	1
+#define remote_free(arena, block)	do {} while (0)
+#define remote_drain(arena)	do {} while (0)
+#define tcache_malloc(size)	NULL
+#define tcache_free(ptr)	0
+#endif
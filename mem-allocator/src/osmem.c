@@ -1,14 +1,38 @@
 // SPDX-License-Identifier: BSD-3-Clause
 
-#include "osmem.h"
-#include "block_meta.h"
-
-#define META_SIZE sizeof(struct block_meta)
-#define MMAP_THRESHOLD (128 * 1024)
-#define N_MAX 2147483647
-
-static struct block_meta *list_head;
-static struct block_meta *list_tail;
+#define _GNU_SOURCE
+#include "heap.h"
+
+// The main arena is the brk heap
+#ifdef OSMEM_THREAD_SAFE
+struct arena main_arena = { .lock = PTHREAD_MUTEX_INITIALIZER };
+#else
+struct arena main_arena;
+#endif
+
+// Blocks allocated with mmap do not belong to any arena. They are indexed by the address
+// of their mapping in a hash table, chained through their prev and next fields. The table
+// doubles in size, in a new mapping, when it holds more than MAPPED_LOAD blocks per bucket.
+#define MAPPED_MIN_BITS 10
+#define MAPPED_LOAD 2UL
+static struct block_meta *mapped_buckets[1 << MAPPED_MIN_BITS];
+static struct block_meta **mapped_index = mapped_buckets;
+static unsigned int mapped_bits = MAPPED_MIN_BITS;
+static size_t mapped_count;
+
+#ifdef OSMEM_THREAD_SAFE
+static pthread_mutex_t mapped_mutex = PTHREAD_MUTEX_INITIALIZER;
+#define mapped_lock()	pthread_mutex_lock(&mapped_mutex)
+#define mapped_unlock()	pthread_mutex_unlock(&mapped_mutex)
+
+void mapped_fork(int stage)
+{
+	fork_mutex(&mapped_mutex, stage);
+}
+#else
+#define mapped_lock()	do {} while (0)
+#define mapped_unlock()	do {} while (0)
+#endif
 
 // This function calculates the amount of padding needed to align a block of memory
 size_t padding(size_t size)
@@ -21,124 +45,476 @@ size_t padding(size_t size)
 	return (8 - (size % 8));
 }
 
-// This function preallocates a block of MMAP_THRESHOLD size using the sbrk syscall
-void heap_preallocation(void)
+// This function returns the bucket of the mapped blocks index for a mapping
+size_t mapped_hash(struct block_meta *block, unsigned int bits)
+{
+	return ((unsigned long)block / getpagesize()) * 0x9E3779B97F4A7C15UL >> (64 - bits);
+}
+
+// This function adds a block to a bucket of the index, the caller holds the mapped lock
+void mapped_push(struct block_meta **bucket, struct block_meta *block)
+{
+	struct mapped_links *links = mapped_links(block);
+
+	links->prev = NULL;
+	links->next = *bucket;
+	if (*bucket)
+		mapped_links(*bucket)->prev = block;
+	*bucket = block;
+}
+
+// This function moves the index to a table twice as big. If the table cannot be mapped,
+// the index keeps its size and only the chains get longer.
+void mapped_grow(void)
+{
+	unsigned int bits = mapped_bits + 1;
+	size_t size = sizeof(*mapped_index) << bits;
+	struct block_meta **index = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	if (index == MAP_FAILED)
+		return;
+
+	for (size_t i = 0; i < 1UL << mapped_bits; i++) {
+		struct block_meta *block = mapped_index[i];
+
+		while (block) {
+			struct block_meta *next = mapped_links(block)->next;
+
+			mapped_push(&index[mapped_hash(block, bits)], block);
+			block = next;
+		}
+	}
+
+	if (mapped_index != mapped_buckets)
+		DIE(munmap(mapped_index, sizeof(*mapped_index) << mapped_bits) == -1, "index munmap syscall failed\n");
+	mapped_index = index;
+	mapped_bits = bits;
+}
+
+void mapped_insert(struct block_meta *block)
+{
+	mapped_lock();
+	if (++mapped_count > MAPPED_LOAD << mapped_bits)
+		mapped_grow();
+	mapped_push(&mapped_index[mapped_hash(block, mapped_bits)], block);
+	mapped_unlock();
+}
+
+void mapped_remove(struct block_meta *block)
+{
+	struct mapped_links *links = mapped_links(block);
+
+	mapped_lock();
+	if (links->prev)
+		mapped_links(links->prev)->next = links->next;
+	else
+		mapped_index[mapped_hash(block, mapped_bits)] = links->next;
+	if (links->next)
+		mapped_links(links->next)->prev = links->prev;
+	mapped_count--;
+	mapped_unlock();
+}
+
+// This function returns 1 if a block is in the index of mapped blocks. The block is not read,
+// so it can be called on a block whose mapping is already gone.
+int mapped_indexed(struct block_meta *block)
+{
+	struct block_meta *current;
+
+	mapped_lock();
+	for (current = mapped_index[mapped_hash(block, mapped_bits)]; current; current = mapped_links(current)->next)
+		if (current == block)
+			break;
+	mapped_unlock();
+
+	return current != NULL;
+}
+
+// This function returns the mapped block of a payload, or NULL if ptr is not a mapped block
+struct block_meta *mapped_find(void *ptr)
+{
+	struct block_meta *block = ptr - META_SIZE - padding(META_SIZE);
+
+	if (block->status != STATUS_MAPPED || !mapped_indexed(block))
+		return NULL;
+
+	return block;
+}
+
+// This function unmaps a mapped block, its mapping starts on the page of its header
+// (or of the links before it)
+void mapped_free(struct block_meta *block)
+{
+	void *start = (void *)(((unsigned long)block - MAPPED_PREFIX) & ~(getpagesize() - 1UL));
+	size_t total_size = (void *)block - start + block->size + META_SIZE + padding(META_SIZE);
+
+	mapped_remove(block);
+	update_mmap_threshold(total_size);
+
+	int ret = munmap(start, total_size);
+
+	DIE(ret == -1, "free munmap syscall failed\n");
+	stat_add(munmap_calls, 1);
+	stat_sub(mapped_bytes, total_size);
+	stat_sub(mapped_blocks, 1);
+}
+
+// This function resizes a mapped block with mremap, the pages are moved instead of copied
+void *mapped_resize(struct block_meta *block, size_t size)
+{
+	size_t old_size = MAPPED_PREFIX + block->size + META_SIZE + padding(META_SIZE);
+	size_t new_size = MAPPED_PREFIX + size + padding(size) + META_SIZE + padding(META_SIZE);
+
+	mapped_remove(block);
+
+	void *map = mremap((void *)block - MAPPED_PREFIX, old_size, new_size, MREMAP_MAYMOVE);
+
+	// The block stays where it is if it cannot be resized
+	if (map == MAP_FAILED) {
+		mapped_insert(block);
+		return NULL;
+	}
+
+	struct block_meta *new_block = map + MAPPED_PREFIX;
+
+	stat_add(mremap_calls, 1);
+	stat_add(mapped_bytes, new_size - old_size);
+
+	new_block->size = size + padding(size);
+	mapped_insert(new_block);
+
+	return (void *)new_block + META_SIZE + padding(META_SIZE);
+}
+
+// This function returns the free list links of a free block
+struct free_links *get_links(struct block_meta *block)
+{
+	return (struct free_links *)((void *)block + META_SIZE + padding(META_SIZE));
+}
+
+// This function encodes a block address as a free list link
+unsigned int block_to_link(struct arena *arena, struct block_meta *block)
 {
-	struct block_meta *new_block = sbrk(MMAP_THRESHOLD);
+	if (!block)
+		return 0;
 
-	new_block->size = MMAP_THRESHOLD - META_SIZE - padding(META_SIZE);
-	DIE(new_block == MAP_FAILED, "malloc sbrk syscall failed\n");
+	return ((void *)block - arena->heap_start) / 8 + 1;
+}
+
+// This function decodes a free list link into a block address
+struct block_meta *link_to_block(struct arena *arena, unsigned int link)
+{
+	if (!link)
+		return NULL;
+
+	return (struct block_meta *)(arena->heap_start + (size_t)(link - 1) * 8);
+}
+
+// This function returns the size class of a free block of the given (aligned) size
+size_t bin_index(size_t size)
+{
+	if (size <= SMALL_BIN_MAX)
+		return size / 8 - 1;
+
+	int order = 63 - __builtin_clzl(size);
+
+	return N_SMALL_BINS + (order - 10) * 4 + ((size >> (order - 2)) & 3);
+}
+
+// This function returns the first non-empty size class starting with idx, or N_BINS if there is none
+size_t next_used_bin(struct arena *arena, size_t idx)
+{
+	for (size_t word = idx / 64; word < BIN_MAP_WORDS; word++) {
+		unsigned long bits = arena->bin_map[word];
+
+		if (word == idx / 64)
+			bits &= ~0UL << (idx % 64);
+		if (bits)
+			return word * 64 + __builtin_ctzl(bits);
+	}
+
+	return N_BINS;
+}
+
+// This function records that the memory of the heap below end may have been written to
+void heap_dirty(struct arena *arena, void *end)
+{
+	if (end > arena->fresh_start)
+		arena->fresh_start = end;
+}
+
+// This function adds a free block to its size class
+void bin_insert(struct arena *arena, struct block_meta *block)
+{
+	if (block->size >= TREE_MIN) {
+		tree_insert(arena, block);
+		arena->bin_map[TREE_BIN / 64] |= 1UL << (TREE_BIN % 64);
+		return;
+	}
+
+	size_t idx = bin_index(block->size);
+
+	class_insert(arena, idx, block);
+	arena->bin_map[idx / 64] |= 1UL << (idx % 64);
+	heap_dirty(arena, get_links(block) + 1);
+}
+
+// This function removes a free block from its size class
+void bin_remove(struct arena *arena, struct block_meta *block)
+{
+	if (block->size >= TREE_MIN) {
+		tree_remove(arena, block);
+		if (!arena->free_tree)
+			arena->bin_map[TREE_BIN / 64] &= ~(1UL << (TREE_BIN % 64));
+		return;
+	}
+
+	size_t idx = bin_index(block->size);
+
+	class_remove(arena, idx, block);
+	if (!arena->bins[idx])
+		arena->bin_map[idx / 64] &= ~(1UL << (idx % 64));
+}
+
+// This function preallocates a block of config.prealloc_size at the start of the arena heap.
+// It returns -1 if the heap cannot grow.
+int heap_preallocation(struct arena *arena)
+{
+	struct block_meta *new_block = heap_grow(arena, config.prealloc_size);
+
+	if (new_block == MAP_FAILED)
+		return -1;
+	new_block->size = config.prealloc_size - META_SIZE - padding(META_SIZE);
 
 	// Mark the block as free and set its next and prev pointers to NULL
 	new_block->status = STATUS_FREE;
-	new_block->next = NULL;
-	new_block->prev = NULL;
+	set_next_block(new_block, NULL);
+	set_prev_block(new_block, NULL);
 
 	// If the list is empty, set the new block as the head of the list
-	if (list_head == NULL)
-		list_head = new_block;
+	if (arena->list_head == NULL)
+		arena->list_head = new_block;
 
 	// // If the list is not empty, add the new block to the end of the list
-	if (list_tail) {
-		list_tail->next = new_block;
-		new_block->prev = list_tail;
+	if (arena->list_tail) {
+		set_next_block(arena->list_tail, new_block);
+		set_prev_block(new_block, arena->list_tail);
 	}
 
 	// Set the new block as the tail of the list
-	list_tail = new_block;
+	arena->list_tail = new_block;
+
+	bin_insert(arena, new_block);
+	return 0;
 }
 
 // This function finds the best free block in the heap to allocate memory of the given size
-struct block_meta *find_best_block(size_t size)
-{
-	struct block_meta *current = list_head;
-	struct block_meta *best_block = NULL;
-	size_t best_size = N_MAX;
-
-	while (current) {
-		// If the current block is free and has enough space to allocate the requested size
-		if (current->status == STATUS_FREE && current->size >= size) {
-			size_t dif = current->size - size;
-			// Update the best size if necessary
-			if (dif < best_size) {
-				best_size = dif;
-				best_block = current;
-			}
-		}
-		current = current->next;
+struct block_meta *find_best_block(struct arena *arena, size_t size)
+{
+	size_t idx = bin_index(size);
+	struct block_meta *current;
+
+	if (idx >= TREE_BIN) {
+		current = tree_best_fit(arena, size);
+		if (!current)
+			return NULL;
+		stat_add(class_hits[idx], 1);
+		return current;
+	}
+
+	// The size class of the request may also hold smaller blocks only
+	current = class_best_fit(arena, idx, size);
+
+	if (!current) {
+		// Otherwise, the smallest block of the next non-empty size class is the best fit
+		size_t next = next_used_bin(arena, idx + 1);
+
+		if (next == N_BINS)
+			return NULL;
+		current = next == TREE_BIN ? tree_best_fit(arena, size) : class_best_fit(arena, next, size);
 	}
-	return best_block;
+
+	stat_add(class_hits[idx], 1);
+	return current;
 }
 
-// This function coalesces adjacent free blocks in the heap
-void coalesce_free_blocks(void)
+// This function merges a block with the next one in the list, which must be free
+void absorb_next_block(struct arena *arena, struct block_meta *block)
 {
-	// If the list of blocks is not empty, iterate through the list
-	if (list_head) {
-		struct block_meta *current = list_head;
+	struct block_meta *next = next_block(arena, block);
+	struct block_meta *after = next_block(arena, next);
 
-		while (current) {
-			// If the current block is free, merge it with adjacent free blocks
-			if (current->status == STATUS_FREE) {
-				while (current->next && current->next->status == STATUS_FREE) {
-					current->size += current->next->size + META_SIZE + padding(META_SIZE);
-					current->next = current->next->next;
-				}
-			}
-			// If the current block is the last block in the list, update the tail pointer
-			if (current->next == NULL)
-				list_tail = current;
-			current = current->next;
-		}
+	block->size += next->size + META_SIZE + padding(META_SIZE);
+	set_next_block(block, after);
+	stat_add(coalesces, 1);
+
+	// Keep the back link of the following block up to date, it acts as its boundary tag
+	if (after)
+		set_prev_block(after, block);
+	else
+		arena->list_tail = block;
+}
+
+// This function tells if the pages inside a free block are given back to the OS. With trimming,
+// they are for the blocks of at least config.trim_threshold bytes, but the tail of the heap is trimmed instead.
+int pages_released(struct arena *arena, struct block_meta *block)
+{
+	return config.trim_threshold && block->size >= config.trim_threshold && block != arena->list_tail;
+}
+
+// This function gives the pages of a free block between start and end back to the OS, they read
+// as zeros when reused. The pages holding the header and the links of the block are kept.
+void release_free_pages(struct block_meta *block, void *start, void *end)
+{
+	size_t page = heap_page_size();
+	void *payload = get_links(block);
+	unsigned long first = ((unsigned long)payload + sizeof(struct tree_node) + page - 1) & ~(page - 1);
+	unsigned long last = ((unsigned long)payload + block->size) & ~(page - 1);
+	unsigned long from = (unsigned long)start & ~(page - 1);
+	unsigned long to = ((unsigned long)end + page - 1) & ~(page - 1);
+
+	if (from < first)
+		from = first;
+	if (to > last)
+		to = last;
+
+	if (from < to) {
+		DIE(madvise((void *)from, to - from, MADV_DONTNEED) == -1, "free madvise syscall failed\n");
+		stat_add(madvise_calls, 1);
 	}
 }
 
-// This function extends the last block in the heap by the given size
-void *extend_last_block(size_t size_new_block, int is_calloc)
+// This function merges a freed block with its free neighbours and returns the merged block.
+// Every free block is already merged and in a size class, so at most two neighbours are absorbed.
+struct block_meta *merge_free_block(struct arena *arena, struct block_meta *block)
 {
-	// Call the sbrk syscall to increase the heap size by the given size
-	void *ret = sbrk(size_new_block - list_tail->size);
+	struct block_meta *next = next_block(arena, block);
+	struct block_meta *prev = prev_block(block);
+	// The pages that may still be in use: those of the freed block, and those of the neighbours
+	// whose pages were not released yet or, if they were, the ones holding their header and links
+	void *start = block;
+	void *end = (void *)get_links(block) + block->size;
+
+	// Merge with the next block
+	if (next && next->status == STATUS_FREE) {
+		end = (void *)get_links(next) + (pages_released(arena, next) ? sizeof(struct tree_node) : next->size);
+		bin_remove(arena, next);
+		absorb_next_block(arena, block);
+	}
+
+	// Merge with the previous block
+	if (prev && prev->status == STATUS_FREE) {
+		if (!pages_released(arena, prev))
+			start = prev;
+		block = prev;
+		bin_remove(arena, block);
+		absorb_next_block(arena, block);
+	}
+
+	if (pages_released(arena, block))
+		release_free_pages(block, start, end);
+
+	return block;
+}
+
+// This function merges a freed block with its free neighbours and adds the result to its size class
+void coalesce_block(struct arena *arena, struct block_meta *block)
+{
+	bin_insert(arena, merge_free_block(arena, block));
+}
+
+// This function gives the free pages at the end of the heap back to the OS
+// when there are at least config.trim_threshold bytes of them
+void heap_trim(struct arena *arena)
+{
+	struct block_meta *tail = arena->list_tail;
+
+	if (!tail || tail->status != STATUS_FREE)
+		return;
+
+	void *payload = get_links(tail);
+	size_t page = heap_page_size();
+
+	// The tail block keeps its header and its free list links (or tree node)
+	void *new_end = (void *)(((unsigned long)payload + sizeof(struct tree_node) + page - 1) & ~(page - 1));
+
+	if (payload + tail->size != arena->heap_end || new_end >= arena->heap_end ||
+		(size_t)(arena->heap_end - new_end) < config.trim_threshold)
+		return;
+
+	bin_remove(arena, tail);
+	if (heap_shrink(arena, arena->heap_end - new_end) == 0)
+		tail->size = new_end - payload;
+	bin_insert(arena, tail);
+}
+
+// This function zeroes out the payload of a block taken from the heap for calloc,
+// except for its part that was never written to since the OS gave it to the heap
+void zero_payload(struct arena *arena, struct block_meta *block)
+{
+	void *payload = (void *)block + META_SIZE + padding(META_SIZE);
+
+	if (arena->fresh_start <= payload)
+		return;
 
-	DIE(ret == MAP_FAILED, "malloc sbrk syscall failed\n");
+	size_t written = arena->fresh_start - payload;
+
+	memset(payload, 0, written < block->size ? written : block->size);
+}
+
+// This function extends the last block in the heap by the given size.
+// It returns NULL if the heap cannot grow.
+void *extend_last_block(struct arena *arena, size_t size_new_block, int is_calloc)
+{
+	void *payload = (void *)arena->list_tail + META_SIZE + padding(META_SIZE);
+
+	// Increase the heap size by the given size
+	void *ret = heap_grow(arena, size_new_block - arena->list_tail->size);
+
+	if (ret == MAP_FAILED)
+		return NULL;
+
+	// The last block leaves its free list if it was free
+	if (arena->list_tail->status == STATUS_FREE)
+		bin_remove(arena, arena->list_tail);
 
 	// Update the size and status of the last block
-	list_tail->size = size_new_block;
-	list_tail->status = STATUS_ALLOC;
+	arena->list_tail->size = size_new_block;
+	arena->list_tail->status = STATUS_ALLOC;
 
-	// If the function is called by calloc, the memory is zeroed out
+	// If the function is called by calloc, the memory is zeroed out, up to the new pages
 	if (is_calloc)
-		memset((void *)list_tail + META_SIZE + padding(META_SIZE), 0, size_new_block);
+		zero_payload(arena, arena->list_tail);
 
-	return ((void *)list_tail + META_SIZE + padding(META_SIZE));
+	return payload;
 }
 
-// This function adds a new block to the heap
-void *add_new_block(size_t size_new_block, int is_calloc)
+// This function adds a new block to the heap. It returns NULL if the heap cannot grow.
+void *add_new_block(struct arena *arena, size_t size_new_block)
 {
-	struct block_meta *new_block = sbrk(size_new_block + META_SIZE + padding(META_SIZE));
+	struct block_meta *new_block = heap_grow(arena, size_new_block + META_SIZE + padding(META_SIZE));
 
-	DIE(new_block == MAP_FAILED, "malloc sbrk syscall failed\n");
+	if (new_block == MAP_FAILED)
+		return NULL;
 	// Update the size and status of the new block
 	new_block->size = size_new_block;
 	new_block->status = STATUS_ALLOC;
 
 	// Update the list of blocks
-	new_block->next = NULL;
-	new_block->prev = list_tail;
-	list_tail->next = new_block;
-	list_tail = new_block;
-
-	// If the function is called by calloc, the memory is zeroed out
-	if (is_calloc)
-		memset((void *)new_block + META_SIZE + padding(META_SIZE), 0, size_new_block);
+	set_next_block(new_block, NULL);
+	set_prev_block(new_block, arena->list_tail);
+	set_next_block(arena->list_tail, new_block);
+	arena->list_tail = new_block;
 
+	// The payload comes right from the OS, calloc does not need to zero it out
 	return ((void *)new_block + META_SIZE + padding(META_SIZE));
 }
 
-// This function splits a block into two blocks
-void split_block(struct block_meta *best_block, size_t size_best_block)
+// This function splits a block into two blocks and returns the second one, which is free
+// but not in a size class yet
+struct block_meta *split_off_block(struct arena *arena, struct block_meta *best_block, size_t size_best_block)
 {
-	struct block_meta *next = best_block->next;
+	struct block_meta *next = next_block(arena, best_block);
 
 	// Newblock starts after the bestblock
 	struct block_meta *new_block = (void *)(best_block) + size_best_block + META_SIZE + padding(META_SIZE);
@@ -146,92 +522,131 @@ void split_block(struct block_meta *best_block, size_t size_best_block)
 	// Set newblock metadata and update the list of blocks
 	new_block->status = STATUS_FREE;
 	new_block->size = best_block->size - size_best_block - META_SIZE - padding(META_SIZE);
-	new_block->next = next;
+	set_next_block(new_block, next);
 
 	if (next)
-		next->prev = new_block;
+		set_prev_block(next, new_block);
 	else
-		list_tail = new_block;
+		arena->list_tail = new_block;
 
-	best_block->next = new_block;
-	new_block->prev = best_block;
+	set_next_block(best_block, new_block);
+	set_prev_block(new_block, best_block);
 
 	best_block->size = size_best_block;
+	stat_add(splits, 1);
+
+	return new_block;
+}
+
+// This function splits a block into two blocks and adds the second one to its size class
+void split_block(struct arena *arena, struct block_meta *best_block, size_t size_best_block)
+{
+	bin_insert(arena, split_off_block(arena, best_block, size_best_block));
 }
 
-// This function allocates memory using mmap syscall
-void *memory_mapping(size_t size, int is_calloc)
+// This function allocates memory using mmap syscall, it returns NULL if there is no memory left
+void *memory_mapping(size_t size)
 {
 	// Allocate memory using mmap syscall
-	size_t total_size = META_SIZE + padding(META_SIZE) + size + padding(size);
-	struct block_meta *new_block = mmap(NULL, total_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	size_t total_size = MAPPED_PREFIX + META_SIZE + padding(META_SIZE) + size + padding(size);
+	void *map = mmap(NULL, total_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	if (map == MAP_FAILED)
+		return NULL;
+
+	struct block_meta *new_block = map + MAPPED_PREFIX;
 
-	DIE(new_block == MAP_FAILED, "malloc mmap syscall failed\n");
+	stat_add(mmap_calls, 1);
+	stat_add(mmap_bytes, total_size);
+	stat_add(mapped_bytes, total_size);
+	stat_add(mapped_blocks, 1);
 
 	// Update the newblock metadata
 	new_block->size = size + padding(size);
 	new_block->status = STATUS_MAPPED;
-	new_block->next = NULL;
-	new_block->prev = list_tail;
-
-	// Update the list of blocks
-	if (list_head == NULL) {
-		list_head = new_block;
-		list_tail = new_block;
-	} else {
-		list_tail->next = new_block;
-		list_tail = new_block;
-	}
-
-	// If the function is called by calloc, the memory is zeroed out
-	if (is_calloc)
-		memset((void *)new_block + META_SIZE + padding(META_SIZE), 0, total_size);
+	mapped_insert(new_block);
+	advise_huge_pages(map, total_size);
 
+	// A new anonymous mapping is already zeroed out, so calloc does not touch its pages
 	return ((void *)new_block + META_SIZE + padding(META_SIZE));
 }
 
-int checkPrealloc(void)
+// This function maps a block whose payload is aligned to alignment bytes. The header is
+// placed right before the aligned payload and the unused pages around it are unmapped.
+void *memory_mapping_aligned(size_t size, size_t alignment)
 {
-	struct block_meta *curr = list_head;
+	size_t page = getpagesize();
+	size_t size_block = size + padding(size);
+	size_t map_size = MAPPED_PREFIX + META_SIZE + padding(META_SIZE) + size_block + alignment;
+	void *map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
 
-	while (curr) {
-		if (curr->status != STATUS_MAPPED)
-			return 0;
-		curr = curr->next;
-	}
+	if (map == MAP_FAILED)
+		return NULL;
+
+	void *payload = (void *)(((unsigned long)map + MAPPED_PREFIX + META_SIZE + padding(META_SIZE) + alignment - 1) &
+							 ~(alignment - 1));
+	struct block_meta *new_block = payload - META_SIZE - padding(META_SIZE);
+	void *start = (void *)(((unsigned long)new_block - MAPPED_PREFIX) & ~(page - 1));
+	void *end = (void *)(((unsigned long)payload + size_block + page - 1) & ~(page - 1));
+
+	if (start != map)
+		DIE(munmap(map, start - map) == -1, "memalign munmap syscall failed\n");
+	if (end < map + map_size)
+		DIE(munmap(end, map + map_size - end) == -1, "memalign munmap syscall failed\n");
 
-	return 1;
+	stat_add(mmap_calls, 1);
+	stat_add(mmap_bytes, end - start);
+	stat_add(mapped_bytes, (void *)new_block - start + size_block + META_SIZE + padding(META_SIZE));
+	stat_add(mapped_blocks, 1);
+
+	new_block->size = size_block;
+	new_block->status = STATUS_MAPPED;
+	mapped_insert(new_block);
+	advise_huge_pages(start, end - start);
+
+	return payload;
 }
 
-void *os_malloc(size_t size)
+// This function checks if the arena heap is still empty
+int checkPrealloc(struct arena *arena)
+{
+	return arena->list_head == NULL;
+}
+
+void *heap_malloc(struct arena *arena, size_t size)
 {
 	// Check if the size is 0 and return error
 	if (size == 0)
 		return NULL;
-	// Coalesce free blocks
-	coalesce_free_blocks();
+	// Finish the frees left pending
+	heap_settle(arena);
 
 	// Check if the size is smaller than the threshold
-	if (size + META_SIZE < MMAP_THRESHOLD) {
+	if (size + META_SIZE < mmap_threshold()) {
 		// Check if the list is null and proceed heap preallocation
-		if (checkPrealloc())
-			heap_preallocation();
+		if (checkPrealloc(arena) && heap_preallocation(arena))
+			return memory_mapping(size);
 
 		size_t size_new_block = size + padding(size);
 		// Find the best block
-		struct block_meta *best_block = find_best_block(size_new_block);
+		struct block_meta *best_block = find_best_block(arena, size_new_block);
 		// If there is no best block
 		if (!best_block) {
+			void *ptr;
+
 			// If the last block is free, extend it
-			if (list_tail->status == STATUS_FREE) {
-				return extend_last_block(size_new_block, 0);
+			if (arena->list_tail->status == STATUS_FREE)
+				ptr = extend_last_block(arena, size_new_block, 0);
 			// Else, add a new block
-			} else {
-				return add_new_block(size_new_block, 0);
-			}
+			else
+				ptr = add_new_block(arena, size_new_block);
+
+			// If the heap cannot grow, the block is mapped instead
+			return ptr ? ptr : memory_mapping(size);
 		// If there is a best block
 		} else {// This function calculates the amount of padding needed to align a block of memory
 			// If the best block is exactly the size of the requested memory
+			bin_remove(arena, best_block);
 			if (size_new_block == best_block->size) {
 				// Update the status of the best block
 				best_block->status = STATUS_ALLOC;
@@ -242,91 +657,271 @@ void *os_malloc(size_t size)
 				size_t new_block_size = best_block->size - size_new_block;
 				// Split the best block
 				if (META_SIZE + padding(META_SIZE) < new_block_size)
-					split_block(best_block, size_new_block);
+					split_block(arena, best_block, size_new_block);
 
 				return ((void *)best_block + META_SIZE + padding(META_SIZE));
 			}
 		}
 	} else {
 		// If the size is bigger than the threshold, use mmap syscall
-		return memory_mapping(size, 0);
+		return memory_mapping(size);
 	}
 }
 
-// This function frees the memory block pointed by ptr
-void os_free(void *ptr)
+// This function allocates count blocks of size bytes (count > 0) as one block of their total size
+// cut in consecutive blocks, so the free lists are searched and updated once for all of them.
+// It returns -1 if the heap cannot grow.
+int heap_malloc_run(struct arena *arena, size_t size, void **ptrs, size_t count)
+{
+	size_t size_block = size + padding(size);
+	size_t stride = META_SIZE + padding(META_SIZE) + size_block;
+	size_t size_run = count * stride - META_SIZE - padding(META_SIZE);
+	struct block_meta *block = find_best_block(arena, size_run);
+
+	// Without a free block big enough, the run is taken at the end of the heap as for heap_malloc
+	if (!block) {
+		void *ptr;
+
+		if (arena->list_tail->status == STATUS_FREE)
+			ptr = extend_last_block(arena, size_run, 0);
+		else
+			ptr = add_new_block(arena, size_run);
+		if (!ptr)
+			return -1;
+		block = arena->list_tail;
+	} else {
+		bin_remove(arena, block);
+		block->status = STATUS_ALLOC;
+		if (META_SIZE + padding(META_SIZE) < block->size - size_run)
+			split_block(arena, block, size_run);
+	}
+
+	struct block_meta *next = next_block(arena, block);
+	// The last block of the run keeps what is left of the block, in case it was not split
+	size_t size_last = block->size - (count - 1) * stride;
+
+	for (size_t i = 0; i < count - 1; i++) {
+		struct block_meta *following = (void *)block + stride;
+
+		ptrs[i] = (void *)block + META_SIZE + padding(META_SIZE);
+		block->size = size_block;
+		following->status = STATUS_ALLOC;
+		set_next_block(block, following);
+		set_prev_block(following, block);
+		block = following;
+	}
+
+	ptrs[count - 1] = (void *)block + META_SIZE + padding(META_SIZE);
+	block->size = size_last;
+	set_next_block(block, next);
+	if (next)
+		set_prev_block(next, block);
+	else
+		arena->list_tail = block;
+
+	heap_dirty(arena, (void *)block + META_SIZE);
+	stat_add(splits, count - 1);
+	return 0;
+}
+
+// This function allocates count blocks of size bytes, in runs of consecutive blocks that stay
+// below the mmap threshold. It returns the number of blocks allocated.
+size_t heap_malloc_batch(struct arena *arena, size_t size, void **ptrs, size_t count)
+{
+	if (size == 0)
+		return 0;
+
+	heap_settle(arena);
+
+	size_t done = 0;
+	int heap = size + META_SIZE < mmap_threshold();
+
+	if (heap && checkPrealloc(arena))
+		heap = !heap_preallocation(arena);
+
+	if (heap) {
+		size_t stride = META_SIZE + padding(META_SIZE) + size + padding(size);
+		size_t run = mmap_threshold() / stride;
+
+		if (run == 0)
+			run = 1;
+
+		while (done < count) {
+			size_t n = count - done < run ? count - done : run;
+
+			if (heap_malloc_run(arena, size, ptrs + done, n))
+				break;
+			done += n;
+		}
+	}
+
+	// Big blocks are mapped one by one, and so are the blocks that do not fit in the heap
+	while (done < count && (ptrs[done] = memory_mapping(size)))
+		done++;
+
+	return done;
+}
+
+// This function allocates a block whose payload is aligned to alignment bytes (a power of two)
+void *heap_memalign(struct arena *arena, size_t alignment, size_t size)
+{
+	// Every block is already aligned to 8 bytes
+	if (alignment <= 8)
+		return heap_malloc(arena, size);
+
+	if (size == 0)
+		return NULL;
+
+	size_t size_new_block = size + padding(size);
+	// Room for the payload at any alignment, with a free block of at least 8 bytes before it
+	size_t size_padded = size_new_block + alignment + META_SIZE + padding(META_SIZE);
+
+	if (size_padded + META_SIZE >= mmap_threshold())
+		return memory_mapping_aligned(size, alignment);
+
+	// Take a block big enough from the free lists or the heap, then carve the aligned block out of it
+	void *ptr = heap_malloc(arena, size_padded);
+
+	if (!ptr)
+		return NULL;
+
+	struct block_meta *block = ptr - META_SIZE - padding(META_SIZE);
+
+	// If the heap cannot grow, the block is mapped at the right alignment instead
+	if (block->status == STATUS_MAPPED) {
+		mapped_free(block);
+		return memory_mapping_aligned(size, alignment);
+	}
+
+	if ((unsigned long)ptr % alignment) {
+		void *aligned = (void *)(((unsigned long)ptr + META_SIZE + padding(META_SIZE) + 8 + alignment - 1) & ~(alignment - 1));
+		struct block_meta *aligned_block = aligned - META_SIZE - padding(META_SIZE);
+
+		struct block_meta *next = next_block(arena, block);
+
+		aligned_block->size = ptr + block->size - aligned;
+		aligned_block->status = STATUS_ALLOC;
+		set_prev_block(aligned_block, block);
+		set_next_block(aligned_block, next);
+		if (next)
+			set_prev_block(next, aligned_block);
+		else
+			arena->list_tail = aligned_block;
+		set_next_block(block, aligned_block);
+		block->size = (void *)aligned_block - ptr;
+
+		// The front fragment goes back to the free lists
+		heap_free(arena, ptr);
+		block = aligned_block;
+		ptr = aligned;
+	}
+
+	// So does the end of the block, merged with the rest heap_malloc() may have split off after it
+	if (block->size - size_new_block >= META_SIZE + padding(META_SIZE) + 8)
+		coalesce_block(arena, split_off_block(arena, block, size_new_block));
+
+	return ptr;
+}
+
+void heap_free(struct arena *arena, void *ptr)
 {
 	if (!ptr)
 		return;
 
+	heap_settle(arena);
+
 	struct block_meta *current = (struct block_meta *)(ptr - META_SIZE - padding(META_SIZE));
 
 	// If the block is allocated, mark it as free
 	if (current->status == STATUS_ALLOC) {
 		current->status = STATUS_FREE;
-	// If the block is mapped, unmap it and remove it from the linked list
+		heap_dirty(arena, ptr + current->size);
+		coalesce_block(arena, current);
+
+		if (config.trim_threshold)
+			heap_trim(arena);
+	// If the block is mapped, unmap it and remove it from the index of mapped blocks
 	} else if (current->status == STATUS_MAPPED) {
-		// If the block is the head of the list, update the head pointer
-		if (current == list_head) {
-			list_head = current->next;
-			if (list_head)
-				list_head->prev = NULL;
-
-		// If the block is the tail of the list, update the tail pointer
-		} else if (current == list_tail) {
-			list_tail = current->prev;
-			if (list_tail)
-				list_tail->next = NULL;
-
-		// If the block is in the middle of the list, update the list
-		} else {
-			current->next->prev = current->prev;
-			current->prev->next = current->next;
-		}
-		int ret = munmap(current, current->size + META_SIZE + padding(META_SIZE));
+		mapped_free(current);
+	}
+}
+
+#ifdef OSMEM_THREAD_SAFE
+// This function queues a block freed by a thread that does not allocate from its arena.
+// The queue is chained through next_freed, the other threads only push to it and
+// remote_drain() takes it whole, so it needs no lock.
+void remote_free(struct arena *arena, struct block_meta *block)
+{
+	unsigned int link = block_to_link(arena, block);
+	unsigned int head = __atomic_load_n(&arena->remote_freed, __ATOMIC_RELAXED);
+
+	do {
+		block->next_freed = head;
+	} while (!__atomic_compare_exchange_n(&arena->remote_freed, &head, link, 1,
+										  __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+	__atomic_fetch_add(&arena->remote_frees, 1, __ATOMIC_RELAXED);
+}
+
+// This function frees the blocks queued by the other threads, the caller holds the arena lock
+void remote_drain(struct arena *arena)
+{
+	if (!__atomic_load_n(&arena->remote_freed, __ATOMIC_RELAXED))
+		return;
+
+	unsigned int link = __atomic_exchange_n(&arena->remote_freed, 0, __ATOMIC_ACQUIRE);
+
+	while (link) {
+		struct block_meta *block = link_to_block(arena, link);
 
-		DIE(ret == -1, "free munmap syscall failed\n");
+		link = block->next_freed;
+		block->status = STATUS_FREE;
+		heap_dirty(arena, (void *)block + META_SIZE + padding(META_SIZE) + block->size);
+		coalesce_block(arena, block);
 	}
 }
+#endif
 
 
-void *os_calloc(size_t nmemb, size_t size)
+void *heap_calloc(struct arena *arena, size_t size)
 {
-	size *= nmemb;
 	// Check if the size is 0 and return error
 	if (size == 0)
 		return NULL;
 
-	// Coalesce free blocks
-	coalesce_free_blocks();
-
-	size_t threshold = getpagesize();
+	// Finish the frees left pending
+	heap_settle(arena);
 
 	// Check if the size is smaller than the threshold
-	if (size + META_SIZE < threshold) {
+	if (size + META_SIZE < config.calloc_threshold) {
 		// Check if the list is null and proceed heap preallocation
-		if (checkPrealloc())
-			heap_preallocation();
+		if (checkPrealloc(arena) && heap_preallocation(arena))
+			return memory_mapping(size);
 
 		size_t size_new_block = size + padding(size);
 		// Find the best block
-		struct block_meta *best_block = find_best_block(size_new_block);
+		struct block_meta *best_block = find_best_block(arena, size_new_block);
 		// If there is no best block
 		if (!best_block) {
+			void *ptr;
+
 			// If the last block is free, extend it
-			if (list_tail->status == STATUS_FREE) {
-				return extend_last_block(size_new_block, 1);
+			if (arena->list_tail->status == STATUS_FREE)
+				ptr = extend_last_block(arena, size_new_block, 1);
 			// Else, add a new block
-			} else {
-				return add_new_block(size_new_block, 1);
-			}
+			else
+				ptr = add_new_block(arena, size_new_block);
+
+			// If the heap cannot grow, the block is mapped instead
+			return ptr ? ptr : memory_mapping(size);
 		// If there is a best block
 		} else {
 			// If the best block is exactly the size of the requested memory
+			bin_remove(arena, best_block);
 			if (size_new_block == best_block->size) {
 				// Update the status of the best block
 				best_block->status = STATUS_ALLOC;
-				memset((void *)best_block + META_SIZE + padding(META_SIZE), 0, best_block->size);
+				zero_payload(arena, best_block);
 				return ((void *)best_block + META_SIZE + padding(META_SIZE));
 			// Else, use the best block and split it if necessary
 			} else {
@@ -334,49 +929,89 @@ void *os_calloc(size_t nmemb, size_t size)
 				size_t new_block_size = best_block->size - size_new_block;
 				// Split the best block
 				if (META_SIZE + padding(META_SIZE) < new_block_size)
-					split_block(best_block, size_new_block);
+					split_block(arena, best_block, size_new_block);
 
-				memset((void *)best_block + META_SIZE + padding(META_SIZE), 0, best_block->size);
+				zero_payload(arena, best_block);
 				return ((void *)best_block + META_SIZE + padding(META_SIZE));
 			}
 		}
 	} else {
 		// If the size is bigger than the threshold, use mmap syscall
-		return memory_mapping(size, 1);
+		return memory_mapping(size);
 	}
 }
 
-// This function finds the last block allocated with brk that is free
-struct block_meta *find_last_brk_free(void)
+// This function returns the last block of the arena heap if it is free
+struct block_meta *find_last_brk_free(struct arena *arena)
 {
-	if (list_tail == NULL)
-		return NULL;
+	if (arena->list_tail && arena->list_tail->status == STATUS_FREE)
+		return arena->list_tail;
 
-	struct block_meta *curr = list_tail;
+	return NULL;
+}
 
-	while (curr->status == STATUS_MAPPED)
-		curr = curr->prev;
+// This function frees the block os_realloc() moved away from. It is merged right away, but it is put
+// in its size class, whose links would overwrite the start of the old contents, by the next call to
+// the arena: until then the old block still reads as it was, which the tests of os_realloc() check.
+void heap_free_moved(struct arena *arena, void *ptr)
+{
+	struct block_meta *block = ptr - META_SIZE - padding(META_SIZE);
 
-	if (curr->status == STATUS_FREE)
-		return curr;
-	else
+	if (block->status != STATUS_ALLOC) {
+		heap_free(arena, ptr);
+		return;
+	}
+
+	block->status = STATUS_FREE;
+	heap_dirty(arena, ptr + block->size);
+	arena->moved_block = block_to_link(arena, merge_free_block(arena, block));
+}
+
+// This function puts the block os_realloc() moved away from in its size class and frees the blocks
+// queued by the other threads. The operations on an arena start with it, so that they find every
+// free block in its size class.
+void heap_settle(struct arena *arena)
+{
+	if (arena->moved_block) {
+		bin_insert(arena, link_to_block(arena, arena->moved_block));
+		arena->moved_block = 0;
+		if (config.trim_threshold)
+			heap_trim(arena);
+	}
+
+	remote_drain(arena);
+}
+
+// This function moves a block to a new block of size bytes and frees it.
+// It returns NULL and keeps the block if there is no memory left.
+void *heap_move(struct arena *arena, void *ptr, size_t size)
+{
+	struct block_meta *current = ptr - META_SIZE - padding(META_SIZE);
+	void *new_ptr = heap_malloc(arena, size);
+
+	if (!new_ptr)
 		return NULL;
+
+	// Copy the contents of the old block to the new block
+	memcpy(new_ptr, ptr, current->size < size ? current->size : size);
+	heap_free_moved(arena, ptr);
+	return new_ptr;
 }
 
 // This function reallocates a block of memory previously allocated with os_malloc or os_calloc
-void *os_realloc(void *ptr, size_t size)
+void *heap_realloc(struct arena *arena, void *ptr, size_t size)
 {
 	// If ptr is NULL, behave like os_malloc(size)
 	if (!ptr)
-		return os_malloc(size);
+		return heap_malloc(arena, size);
 
 	// If size is 0, behave like os_free(ptr)
 	if (size == 0) {
-		os_free(ptr);
+		heap_free(arena, ptr);
 		return NULL;
 	}
 
-	coalesce_free_blocks();
+	heap_settle(arena);
 	size_t size_new_block = size + padding(size);
 
 	// Get a pointer to the metadata of the current block
@@ -386,77 +1021,457 @@ void *os_realloc(void *ptr, size_t size)
 	if (current->status == STATUS_FREE)
 		return NULL;
 
+	// If the current block is mapped and stays big enough to be mapped, resize its mapping
+	if (current->status == STATUS_MAPPED && size + META_SIZE >= mmap_threshold() && config.mremap &&
+		((unsigned long)current - MAPPED_PREFIX) % getpagesize() == 0)
+		return mapped_resize(current, size);
+
 	// If the current block is mapped, allocate a new block of the requested size
-	if (current->status == STATUS_MAPPED) {
-		void *new_ptr = os_malloc(size);
+	if (current->status == STATUS_MAPPED)
+		return heap_move(arena, ptr, size);
 
-		// Copy the contents of the old block to the new block
-		if (current->size < size)
-			memcpy(new_ptr, ptr, current->size);
-		else
-			memcpy(new_ptr, ptr, size);
-		// Free the old block
-		os_free(ptr);
-		return new_ptr;
-	}
 	// If the current block is the last block in the list
-	if (current == list_tail) {
+	if (current == arena->list_tail) {
 		// If size is bigger than the current block size, extend the block
 		if (current->size < size_new_block) {
-			void *ptr = extend_last_block(size_new_block, 0);
+			// If the heap cannot grow, the block moves to a mapping
+			if (!extend_last_block(arena, size_new_block, 0))
+				return heap_move(arena, ptr, size);
 			return ptr;
 		// Else, split the block if necessary
 		} else {
-			if (current->size - size_new_block >= META_SIZE + padding(META_SIZE) + 8)
-				split_block(current, size_new_block);
+			if (current->size - size_new_block >= META_SIZE + padding(META_SIZE) + 8) {
+				heap_dirty(arena, ptr + current->size);
+				split_block(arena, current, size_new_block);
+			}
 			return ptr;
 		}
 	} else {
+		struct block_meta *next = next_block(arena, current);
+
 		// If the next block is free, merge the two blocks
-		if (current->next->status == STATUS_FREE) {
-			current->size += current->next->size + META_SIZE + padding(META_SIZE);
-			if (current->next->next != NULL)
-				current->next->next->prev = current;
-			current->next = current->next->next;
+		if (next->status == STATUS_FREE) {
+			bin_remove(arena, next);
+			absorb_next_block(arena, current);
 		}
 		// If the size is smaller than the current block size, split the block if necessary
 		if (size_new_block <= current->size) {
-			if (current->size - size_new_block >= META_SIZE + padding(META_SIZE) + 8)
-				split_block(current, size_new_block);
+			if (current->size - size_new_block >= META_SIZE + padding(META_SIZE) + 8) {
+				heap_dirty(arena, ptr + current->size);
+				split_block(arena, current, size_new_block);
+
+				// The rest of the block may hold pages in use, unlike the other free blocks
+				struct block_meta *rest = next_block(arena, current);
+
+				if (pages_released(arena, rest))
+					release_free_pages(rest, rest, (void *)get_links(rest) + rest->size);
+			}
 			return ptr;
 
 		} else {
 			// If the size is bigger than the threshold, allocate a new block
-			if (size_new_block >= MMAP_THRESHOLD) {
-				void *new_ptr = os_malloc(size);
+			if (size_new_block >= mmap_threshold())
+				return heap_move(arena, ptr, size);
 
-				memcpy(new_ptr, ptr, current->size);
-				os_free(ptr);
-				return new_ptr;
-			}
 
-			struct block_meta *best_block = find_best_block(size_new_block);
-			struct block_meta *last_free = find_last_brk_free();
+			struct block_meta *best_block = find_best_block(arena, size_new_block);
+			struct block_meta *last_free = find_last_brk_free(arena);
 
 			//  If there is no best block and the last block alloced with brk is free, extend it
 			if (last_free && best_block == NULL) {
-				void *ret = sbrk(size_new_block - last_free->size);
-
-				DIE(ret == MAP_FAILED, "malloc sbrk syscall failed\n");
+				// If the heap cannot grow, the block moves to a mapping
+				if (heap_grow(arena, size_new_block - last_free->size) == MAP_FAILED)
+					return heap_move(arena, ptr, size);
+				bin_remove(arena, last_free);
 				last_free->size = size_new_block;
 				last_free->status = STATUS_ALLOC;
 
 				memcpy((void *)last_free + META_SIZE + padding(META_SIZE), ptr, current->size);
-				os_free(ptr);
+				heap_free_moved(arena, ptr);
 				return (void *)last_free + META_SIZE + padding(META_SIZE);
 			// Else, allocate a new block of the requested size
 			} else {
-				void *new_ptr = os_malloc(size);
-
-				memcpy(new_ptr, ptr, current->size);
-				os_free(ptr);
-				return new_ptr;
+				return heap_move(arena, ptr, size);
 			}
 		}
 	}
 }
+
+// This function frees a block in the arena it belongs to
+void arena_free(void *ptr)
+{
+	struct block_meta *block = mapped_find(ptr);
+
+	// Mapped blocks do not need the lock of any arena
+	if (block) {
+		mapped_free(block);
+		return;
+	}
+
+	block = ptr - META_SIZE - padding(META_SIZE);
+
+	struct arena *arena = arena_of(block);
+
+	// The blocks of the other arenas are left to them, their owner frees them on its next allocation
+	if (!arena_is_local(arena)) {
+		remote_free(arena, block);
+		return;
+	}
+
+	heap_lock(arena);
+	heap_free(arena, ptr);
+	heap_unlock(arena);
+}
+
+void *do_malloc(size_t size)
+{
+	if (config.debug)
+		return debug_malloc(size);
+
+	// Small requests are served from the slabs or the thread cache when possible
+	void *ptr = slab_malloc(size);
+
+	if (ptr)
+		return ptr;
+
+	ptr = tcache_malloc(size);
+
+	if (ptr)
+		return ptr;
+
+	struct arena *arena = thread_arena();
+
+	heap_lock(arena);
+	ptr = heap_malloc(arena, size);
+	heap_unlock(arena);
+
+	return ptr;
+}
+
+// A call made while the thread is already inside the allocator (from a signal handler) is served
+// from the emergency reserve, the heap it would use may be in the middle of an update
+void *os_malloc(size_t size)
+{
+	if (in_allocator)
+		return reserve_alloc(size);
+
+	in_allocator = 1;
+	void *ptr = do_malloc(size);
+
+	if (config.profile_interval)
+		profile_malloc(ptr, size);
+	in_allocator = 0;
+
+	return ptr;
+}
+
+void do_free(void *ptr, void *caller)
+{
+	// The blocks of the reserve are never reused
+	if (reserve_owns(ptr))
+		return;
+
+	if (config.profile_interval)
+		profile_free(ptr);
+
+	if (config.debug) {
+		debug_free(ptr, caller);
+		return;
+	}
+
+	if (slab_owns(ptr)) {
+		slab_free(ptr, caller);
+		return;
+	}
+
+	if (tcache_free(ptr))
+		return;
+
+	arena_free(ptr);
+}
+
+// A block freed while the thread is already inside the allocator is left allocated
+void os_free(void *ptr)
+{
+	if (!ptr || in_allocator)
+		return;
+
+	in_allocator = 1;
+	do_free(ptr, __builtin_return_address(0));
+	in_allocator = 0;
+}
+
+// This function returns the number of bytes the program can use in a block, at least the size
+// it asked for. In the hardened mode it is exactly that size, the canary comes right after it.
+size_t os_malloc_usable_size(void *ptr)
+{
+	if (!ptr)
+		return 0;
+
+	if (reserve_owns(ptr))
+		return reserve_size(ptr);
+
+	if (config.debug)
+		return debug_check(ptr, __builtin_return_address(0));
+
+	if (slab_owns(ptr))
+		return slab_size(ptr);
+
+	return ((struct block_meta *)(ptr - META_SIZE - padding(META_SIZE)))->size;
+}
+
+// This function frees a block whose size the program knows. The size is only checked by the
+// hardened mode, which reports a size other than the requested one; otherwise it is os_free().
+void os_free_sized(void *ptr, size_t size)
+{
+	if (!ptr || in_allocator)
+		return;
+
+	if (config.debug && !reserve_owns(ptr) && debug_check(ptr, __builtin_return_address(0)) != size)
+		debug_report("free with a wrong size", ptr, __builtin_return_address(0));
+
+	in_allocator = 1;
+	do_free(ptr, __builtin_return_address(0));
+	in_allocator = 0;
+}
+
+size_t os_malloc_batch(size_t size, void **ptrs, size_t count)
+{
+	size_t done = 0;
+
+	if (in_allocator)
+		return 0;
+
+	in_allocator = 1;
+	// Each block of the hardened mode and of the profiler gets its own checks and samples
+	if (config.debug || config.profile_interval) {
+		while (done < count && (ptrs[done] = do_malloc(size))) {
+			if (config.profile_interval)
+				profile_malloc(ptrs[done], size);
+			done++;
+		}
+		in_allocator = 0;
+		return done;
+	}
+
+	while (done < count && (ptrs[done] = slab_malloc(size)))
+		done++;
+
+	if (done < count) {
+		struct arena *arena = thread_arena();
+
+		heap_lock(arena);
+		done += heap_malloc_batch(arena, size, ptrs + done, count - done);
+		heap_unlock(arena);
+	}
+	in_allocator = 0;
+
+	return done;
+}
+
+// This function frees the blocks of a batch. The heap blocks of one arena that follow each
+// other in ptrs are freed under a single lock, without going through the thread cache.
+void os_free_batch(void **ptrs, size_t count)
+{
+	size_t i = 0;
+
+	if (in_allocator)
+		return;
+
+	in_allocator = 1;
+	while (i < count) {
+		void *ptr = ptrs[i++];
+
+		if (!ptr)
+			continue;
+
+		struct block_meta *block = ptr - META_SIZE - padding(META_SIZE);
+
+		if (config.debug || config.profile_interval || slab_owns(ptr) || reserve_owns(ptr) ||
+			block->status != STATUS_ALLOC) {
+			do_free(ptr, __builtin_return_address(0));
+			continue;
+		}
+
+		struct arena *arena = arena_of(block);
+
+		if (!arena_is_local(arena)) {
+			remote_free(arena, block);
+			continue;
+		}
+
+		heap_lock(arena);
+		heap_free(arena, ptr);
+		while (i < count && ptrs[i] && !slab_owns(ptrs[i])) {
+			block = ptrs[i] - META_SIZE - padding(META_SIZE);
+			if (block->status != STATUS_ALLOC || arena_of(block) != arena)
+				break;
+			heap_free(arena, ptrs[i++]);
+		}
+		heap_unlock(arena);
+	}
+	in_allocator = 0;
+}
+
+void *do_memalign(size_t alignment, size_t size)
+{
+
+	if (config.debug)
+		return debug_memalign(alignment, size);
+
+	struct arena *arena = thread_arena();
+
+	heap_lock(arena);
+	void *ptr = heap_memalign(arena, alignment, size);
+
+	heap_unlock(arena);
+
+	return ptr;
+}
+
+void *os_memalign(size_t alignment, size_t size)
+{
+	// The alignment must be a power of two
+	if (alignment == 0 || (alignment & (alignment - 1))) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	// The blocks of the reserve are aligned to 16 bytes
+	if (in_allocator)
+		return alignment <= 16 ? reserve_alloc(size) : NULL;
+
+	in_allocator = 1;
+	void *ptr = do_memalign(alignment, size);
+
+	if (config.profile_interval)
+		profile_malloc(ptr, size);
+	in_allocator = 0;
+
+	return ptr;
+}
+
+void *os_aligned_alloc(size_t alignment, size_t size)
+{
+	return os_memalign(alignment, size);
+}
+
+int os_posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+	// The alignment must be a power of two and a multiple of the size of a pointer
+	if (!alignment || alignment % sizeof(void *) || (alignment & (alignment - 1)))
+		return EINVAL;
+
+	void *ptr = os_memalign(alignment, size);
+
+	if (!ptr && size)
+		return ENOMEM;
+
+	*memptr = ptr;
+	return 0;
+}
+
+void *do_calloc(size_t nmemb, size_t size)
+{
+	size_t total;
+
+	// The size of the array must not overflow
+	if (__builtin_mul_overflow(nmemb, size, &total)) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	if (config.debug)
+		return debug_calloc(total);
+
+	void *ptr = slab_malloc(total);
+
+	if (!ptr)
+		ptr = tcache_malloc(total);
+
+	if (ptr) {
+		memset(ptr, 0, total);
+		return ptr;
+	}
+
+	struct arena *arena = thread_arena();
+
+	heap_lock(arena);
+	ptr = heap_calloc(arena, total);
+	heap_unlock(arena);
+
+	return ptr;
+}
+
+void *os_calloc(size_t nmemb, size_t size)
+{
+	size_t total;
+
+	// The reserve is never reused, its blocks are zeroed out
+	if (in_allocator)
+		return __builtin_mul_overflow(nmemb, size, &total) ? NULL : reserve_alloc(total);
+
+	in_allocator = 1;
+	void *ptr = do_calloc(nmemb, size);
+
+	if (config.profile_interval)
+		profile_malloc(ptr, nmemb * size);
+	in_allocator = 0;
+
+	return ptr;
+}
+
+void *do_realloc(void *ptr, size_t size, void *caller)
+{
+	if (config.debug)
+		return debug_realloc(ptr, size, caller);
+
+	if (slab_owns(ptr))
+		return slab_realloc(ptr, size, caller);
+
+	struct arena *arena = thread_arena();
+
+	// A block on a heap can only be resized by the arena it belongs to
+	if (ptr && !mapped_find(ptr))
+		arena = arena_of(ptr - META_SIZE - padding(META_SIZE));
+
+	heap_lock(arena);
+	ptr = heap_realloc(arena, ptr, size);
+	heap_unlock(arena);
+
+	return ptr;
+}
+
+// This function moves a block of the reserve, or any block when the thread is already inside
+// the allocator, to a new block. The old block is left as it is.
+void *realloc_aside(void *ptr, size_t size)
+{
+	void *new_ptr = in_allocator ? reserve_alloc(size) : os_malloc(size);
+
+	if (!ptr || !new_ptr)
+		return new_ptr;
+
+	size_t old_size = os_malloc_usable_size(ptr);
+
+	memcpy(new_ptr, ptr, old_size < size ? old_size : size);
+
+	return new_ptr;
+}
+
+void *os_realloc(void *ptr, size_t size)
+{
+	if (in_allocator || reserve_owns(ptr))
+		return realloc_aside(ptr, size);
+
+	in_allocator = 1;
+	if (config.profile_interval)
+		profile_free(ptr);
+
+	ptr = do_realloc(ptr, size, __builtin_return_address(0));
+
+	if (config.profile_interval)
+		profile_malloc(ptr, size);
+	in_allocator = 0;
+
+	return ptr;
+}
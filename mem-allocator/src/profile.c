@@ -0,0 +1,325 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+// Sampling heap profiler, enabled with OSMEM_PROFILE=<bytes>. About once every that many
+// allocated bytes, the backtrace of the allocation is recorded and the block is kept in a
+// side table until it is freed. The blocks still in use are written as folded stacks
+// ("caller;callee;... bytes", the input of flamegraph.pl) when the program gets SIGUSR2,
+// when it exits and when os_malloc_profile_dump() is called.
+//
+// Every sample stands for the interval bytes (or for its own size, if bigger), so the
+// bytes of a stack are an estimate of the bytes it has in use.
+
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <execinfo.h>
+#include <fcntl.h>
+#include <signal.h>
+
+#include "heap.h"
+
+#define PROFILE_DEPTH 32
+// Sizes of the tables, they are mapped when profiling starts and never grow
+#define PROFILE_SAMPLES (1 << 16)
+#define PROFILE_STACKS (1 << 13)
+#define PROFILE_FILTER (1 << 16)
+
+struct profile_stack {
+	unsigned long hash;
+	int depth;
+	void *frames[PROFILE_DEPTH];
+	unsigned long live_count;
+	size_t live_bytes;
+};
+
+struct profile_sample {
+	void *ptr;
+	unsigned int stack;
+	size_t weight;
+};
+
+static struct profile_sample *samples;
+static size_t sample_count;
+static struct profile_stack *stacks;
+static size_t stack_count;
+// Number of sampled blocks for each hash of their address, read without the lock by os_free()
+static unsigned short *filter;
+
+static volatile sig_atomic_t dump_requested;
+static char dump_path[256];
+
+static __thread long countdown;
+static __thread unsigned long random_state;
+
+#ifdef OSMEM_THREAD_SAFE
+static pthread_mutex_t profile_mutex = PTHREAD_MUTEX_INITIALIZER;
+#define profile_lock()		pthread_mutex_lock(&profile_mutex)
+#define profile_unlock()	pthread_mutex_unlock(&profile_mutex)
+
+void profile_fork(int stage)
+{
+	fork_mutex(&profile_mutex, stage);
+}
+#else
+#define profile_lock()		do {} while (0)
+#define profile_unlock()	do {} while (0)
+#endif
+
+void profile_signal(int signo)
+{
+	(void)signo;
+	dump_requested = 1;
+}
+
+// This function sets up the profiler if OSMEM_PROFILE is set
+void profile_init(void)
+{
+	samples = mmap(NULL, PROFILE_SAMPLES * sizeof(*samples), PROT_READ | PROT_WRITE,
+				   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	stacks = mmap(NULL, PROFILE_STACKS * sizeof(*stacks), PROT_READ | PROT_WRITE,
+				  MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	filter = mmap(NULL, PROFILE_FILTER * sizeof(*filter), PROT_READ | PROT_WRITE,
+				  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (samples == MAP_FAILED || stacks == MAP_FAILED || filter == MAP_FAILED) {
+		config.profile_interval = 0;
+		return;
+	}
+
+	char *path = getenv("OSMEM_PROFILE_FILE");
+
+	if (path && *path)
+		snprintf(dump_path, sizeof(dump_path), "%s", path);
+	else
+		snprintf(dump_path, sizeof(dump_path), "osmem-%d.heap", getpid());
+
+	// The first backtrace() loads the unwinder, which allocates with the malloc() of libc
+	void *frames[1];
+
+	backtrace(frames, 1);
+
+	struct sigaction sa = { .sa_handler = profile_signal, .sa_flags = SA_RESTART };
+
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGUSR2, &sa, NULL);
+}
+
+size_t filter_index(void *ptr)
+{
+	return ((unsigned long)ptr >> 3) * 0x9e3779b97f4a7c15UL >> (64 - 16);
+}
+
+size_t sample_index(void *ptr)
+{
+	return ((unsigned long)ptr >> 3) * 0xc2b2ae3d27d4eb4fUL >> (64 - 16);
+}
+
+// This function returns the slot of a sampled block, or the empty slot where it would go
+size_t sample_lookup(void *ptr)
+{
+	size_t pos = sample_index(ptr);
+
+	while (samples[pos].ptr && samples[pos].ptr != ptr)
+		pos = (pos + 1) % PROFILE_SAMPLES;
+
+	return pos;
+}
+
+// This function finds the record of a backtrace, adding it if needed,
+// returns PROFILE_STACKS if the table is full
+unsigned int stack_lookup(void **frames, int depth)
+{
+	unsigned long hash = depth;
+
+	for (int i = 0; i < depth; i++)
+		hash = (hash ^ (unsigned long)frames[i]) * 0x100000001b3UL;
+
+	size_t pos = hash % PROFILE_STACKS;
+
+	for (size_t tries = 0; tries < PROFILE_STACKS; tries++, pos = (pos + 1) % PROFILE_STACKS) {
+		struct profile_stack *stack = &stacks[pos];
+
+		if (stack->depth == 0) {
+			// Keep room in the table, so that lookups stay short
+			if (stack_count >= PROFILE_STACKS * 3 / 4)
+				return PROFILE_STACKS;
+
+			stack->hash = hash;
+			stack->depth = depth;
+			memcpy(stack->frames, frames, depth * sizeof(void *));
+			stack_count++;
+			return pos;
+		}
+
+		if (stack->hash == hash && stack->depth == depth &&
+			!memcmp(stack->frames, frames, depth * sizeof(void *)))
+			return pos;
+	}
+
+	return PROFILE_STACKS;
+}
+
+void sample_remove(size_t pos)
+{
+	struct profile_sample *sample = &samples[pos];
+	struct profile_stack *stack = &stacks[sample->stack];
+
+	stack->live_count--;
+	stack->live_bytes -= sample->weight;
+	__atomic_fetch_sub(&filter[filter_index(sample->ptr)], 1, __ATOMIC_RELAXED);
+	sample_count--;
+
+	// Move back the samples after it that would not be found anymore
+	for (size_t next = (pos + 1) % PROFILE_SAMPLES; samples[next].ptr; next = (next + 1) % PROFILE_SAMPLES) {
+		size_t home = sample_index(samples[next].ptr);
+
+		if ((next > pos && (home <= pos || home > next)) || (next < pos && home <= pos && home > next)) {
+			samples[pos] = samples[next];
+			pos = next;
+		}
+	}
+	samples[pos].ptr = NULL;
+}
+
+// This function picks the number of bytes until the next sample, around the interval
+long next_interval(void)
+{
+	if (!random_state)
+		random_state = (unsigned long)&random_state | 1;
+
+	random_state ^= random_state << 13;
+	random_state ^= random_state >> 7;
+	random_state ^= random_state << 17;
+
+	return config.profile_interval / 2 + random_state % (config.profile_interval + 1);
+}
+
+void profile_sample(void *ptr, size_t size)
+{
+	void *frames[PROFILE_DEPTH];
+	int depth = backtrace(frames, PROFILE_DEPTH);
+	size_t weight = size > config.profile_interval ? size : config.profile_interval;
+
+	profile_lock();
+	// A block handed out again without being freed, by slab_realloc() for instance
+	size_t pos = sample_lookup(ptr);
+
+	if (samples[pos].ptr) {
+		sample_remove(pos);
+		pos = sample_lookup(ptr);
+	}
+
+	unsigned int stack = stack_lookup(frames, depth);
+
+	if (stack != PROFILE_STACKS && sample_count < PROFILE_SAMPLES * 3 / 4) {
+		samples[pos].ptr = ptr;
+		samples[pos].stack = stack;
+		samples[pos].weight = weight;
+		sample_count++;
+		stacks[stack].live_count++;
+		stacks[stack].live_bytes += weight;
+		__atomic_fetch_add(&filter[filter_index(ptr)], 1, __ATOMIC_RELAXED);
+	}
+	profile_unlock();
+}
+
+void profile_malloc(void *ptr, size_t size)
+{
+	if (dump_requested) {
+		dump_requested = 0;
+		os_malloc_profile_dump(NULL);
+	}
+
+	if (!ptr)
+		return;
+
+	countdown -= size;
+	if (countdown > 0)
+		return;
+
+	countdown = next_interval();
+	profile_sample(ptr, size);
+}
+
+void profile_free(void *ptr)
+{
+	// Most blocks were not sampled
+	if (!ptr || !__atomic_load_n(&filter[filter_index(ptr)], __ATOMIC_RELAXED))
+		return;
+
+	profile_lock();
+	size_t pos = sample_lookup(ptr);
+
+	if (samples[pos].ptr)
+		sample_remove(pos);
+	profile_unlock();
+}
+
+// This function writes the name of the function a return address is in
+void print_frame(struct stats_out *out, void *addr)
+{
+	Dl_info info;
+
+	// The return address may be right after the end of the calling function
+	if (dladdr(addr - 1, &info) && info.dli_sname) {
+		fctprintf(stats_putchar, out, "%s", info.dli_sname);
+	} else if (info.dli_fname) {
+		const char *name = strrchr(info.dli_fname, '/');
+
+		fctprintf(stats_putchar, out, "%s+0x%lx", name ? name + 1 : info.dli_fname,
+				  (unsigned long)(addr - info.dli_fbase));
+	} else {
+		fctprintf(stats_putchar, out, "0x%lx", (unsigned long)addr);
+	}
+}
+
+// This function returns 1 if a return address is inside this library
+int own_frame(void *addr)
+{
+	Dl_info info, own;
+
+	return dladdr(addr, &info) && dladdr(os_malloc, &own) && info.dli_fbase == own.dli_fbase;
+}
+
+int os_malloc_profile_dump(const char *path)
+{
+	if (!config.profile_interval)
+		return -1;
+
+	int fd = open(path ? path : dump_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+	if (fd < 0)
+		return -1;
+
+	struct stats_out out = { .fd = fd };
+
+	profile_lock();
+	for (size_t i = 0; i < PROFILE_STACKS; i++) {
+		struct profile_stack *stack = &stacks[i];
+
+		if (!stack->live_count)
+			continue;
+
+		// The frames of the allocator itself are left out, the outermost caller comes first
+		int first = 0;
+
+		while (first < stack->depth - 1 && own_frame(stack->frames[first]))
+			first++;
+
+		for (int frame = stack->depth - 1; frame >= first; frame--) {
+			print_frame(&out, stack->frames[frame]);
+			stats_putchar(frame > first ? ';' : ' ', &out);
+		}
+		fctprintf(stats_putchar, &out, "%zu\n", stack->live_bytes);
+	}
+	profile_unlock();
+
+	stats_flush(&out);
+	close(fd);
+
+	return 0;
+}
+
+__attribute__((destructor))
+void profile_at_exit(void)
+{
+	os_malloc_profile_dump(NULL);
+}
@@ -0,0 +1,152 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+// Bump-pointer regions, for objects that are all freed at the same time (the objects of a
+// request, of a parse, of a frame...). A region hands out memory from chunks taken with
+// os_malloc() by moving a pointer forward, its objects are never freed one by one:
+// os_region_reset() gives them all back at once and keeps the chunks for the next round,
+// os_region_destroy() frees the chunks. A region has no lock, it is used by one thread at a time.
+
+#include "heap.h"
+
+#define REGION_CHUNK_SIZE (64 * 1024)
+#define REGION_CHUNK_MIN 1024
+// Objects bigger than this share of the chunk size get a chunk of their own
+#define REGION_BIG_SHARE 4
+
+struct region_chunk {
+	struct region_chunk *next;
+	size_t size;
+};
+
+#define CHUNK_DATA(chunk) ((void *)((struct region_chunk *)(chunk) + 1))
+
+struct os_region {
+	// The chunks in the order they are used, the region itself is at the start of the first one
+	struct region_chunk *chunks;
+	struct region_chunk *current;
+	// Chunks of the big objects, freed by os_region_reset()
+	struct region_chunk *big_chunks;
+
+	void *top;
+	void *end;
+	size_t chunk_size;
+};
+
+struct os_region *os_region_create(size_t chunk_size)
+{
+	if (chunk_size == 0)
+		chunk_size = REGION_CHUNK_SIZE;
+	if (chunk_size < REGION_CHUNK_MIN)
+		chunk_size = REGION_CHUNK_MIN;
+	chunk_size += padding(chunk_size);
+
+	struct region_chunk *chunk = os_malloc(chunk_size);
+
+	if (!chunk)
+		return NULL;
+
+	chunk->next = NULL;
+	chunk->size = chunk_size;
+
+	struct os_region *region = CHUNK_DATA(chunk);
+
+	region->chunks = chunk;
+	region->current = chunk;
+	region->big_chunks = NULL;
+	region->top = region + 1;
+	region->end = (void *)chunk + chunk_size;
+	region->chunk_size = chunk_size;
+
+	return region;
+}
+
+// This function serves the requests that do not fit in what is left of the current chunk
+void *region_alloc_slow(struct os_region *region, size_t size)
+{
+	// A big object does not end the current chunk, it would waste most of it
+	if (size > region->chunk_size / REGION_BIG_SHARE) {
+		if (size > (size_t)-1 - sizeof(struct region_chunk))
+			return NULL;
+
+		struct region_chunk *chunk = os_malloc(sizeof(struct region_chunk) + size);
+
+		if (!chunk)
+			return NULL;
+
+		chunk->size = sizeof(struct region_chunk) + size;
+		chunk->next = region->big_chunks;
+		region->big_chunks = chunk;
+
+		return CHUNK_DATA(chunk);
+	}
+
+	// The chunks kept by os_region_reset() are used again before new ones are taken
+	struct region_chunk *chunk = region->current->next;
+
+	if (!chunk) {
+		chunk = os_malloc(region->chunk_size);
+		if (!chunk)
+			return NULL;
+
+		chunk->next = NULL;
+		chunk->size = region->chunk_size;
+		region->current->next = chunk;
+	}
+
+	region->current = chunk;
+	region->top = CHUNK_DATA(chunk) + size;
+	region->end = (void *)chunk + chunk->size;
+
+	return CHUNK_DATA(chunk);
+}
+
+void *os_region_alloc(struct os_region *region, size_t size)
+{
+	if (size == 0 || size > (size_t)-1 - 8)
+		return NULL;
+
+	size += padding(size);
+
+	if (size <= (size_t)(region->end - region->top)) {
+		void *ptr = region->top;
+
+		region->top += size;
+		return ptr;
+	}
+
+	return region_alloc_slow(region, size);
+}
+
+void os_region_reset(struct os_region *region)
+{
+	while (region->big_chunks) {
+		struct region_chunk *chunk = region->big_chunks;
+
+		region->big_chunks = chunk->next;
+		os_free(chunk);
+	}
+
+	region->current = region->chunks;
+	region->top = region + 1;
+	region->end = (void *)region->chunks + region->chunks->size;
+}
+
+void os_region_destroy(struct os_region *region)
+{
+	if (!region)
+		return;
+
+	os_region_reset(region);
+
+	// The first chunk holds the region, it goes last
+	struct region_chunk *chunk = region->chunks->next;
+
+	while (chunk) {
+		struct region_chunk *next = chunk->next;
+
+		os_free(chunk);
+		chunk = next;
+	}
+
+	os_free(region->chunks);
+}
@@ -0,0 +1,57 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+// Emergency reserve, a static pool served by moving an offset forward with an atomic
+// compare-and-swap. It never touches the heaps, their locks or the lists of blocks, so it
+// can be used from a signal handler: os_malloc_emergency() takes from it directly, and the
+// allocator takes from it when it is called again by a thread that is already inside it (a
+// signal handler that interrupted an allocation). The blocks of the reserve are never reused,
+// os_free() ignores them.
+
+#include "heap.h"
+
+#define RESERVE_SIZE (64 * 1024)
+// Every block starts with its size, the payloads stay 16-byte aligned
+#define RESERVE_HEADER 16
+
+static char reserve[RESERVE_SIZE] __attribute__((aligned(16)));
+static size_t reserve_top;
+
+__thread int in_allocator __attribute__((tls_model("initial-exec")));
+
+void *reserve_alloc(size_t size)
+{
+	if (size == 0 || size > RESERVE_SIZE)
+		return NULL;
+
+	size_t total = RESERVE_HEADER + ((size + 15) & ~15UL);
+	size_t top = __atomic_load_n(&reserve_top, __ATOMIC_RELAXED);
+
+	do {
+		if (total > RESERVE_SIZE - top) {
+			errno = ENOMEM;
+			return NULL;
+		}
+	} while (!__atomic_compare_exchange_n(&reserve_top, &top, top + total, 1,
+										  __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+	*(size_t *)(reserve + top) = size;
+
+	// The reserve is in the bss and never reused, the payload is still zeroed out
+	return reserve + top + RESERVE_HEADER;
+}
+
+int reserve_owns(void *ptr)
+{
+	return (char *)ptr >= reserve && (char *)ptr < reserve + RESERVE_SIZE;
+}
+
+// This function returns the size requested for a block of the reserve
+size_t reserve_size(void *ptr)
+{
+	return *(size_t *)(ptr - RESERVE_HEADER);
+}
+
+void *os_malloc_emergency(size_t size)
+{
+	return reserve_alloc(size);
+}
@@ -0,0 +1,253 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "heap.h"
+
+// Objects of up to SLAB_MAX bytes are rounded up to a multiple of 16 and carved out of
+// SLAB_SIZE slabs of one size each. The slabs are aligned to their size inside a single
+// reserved region, so the slab of an object is found by masking its address and the
+// objects need no header.
+#define SLAB_SIZE (64 * 1024)
+#define SLAB_REGION_SIZE (1UL << 30)
+#define SLAB_CLASSES (SLAB_MAX / 16)
+#define SLAB_MAP_WORDS (SLAB_SIZE / 16 / 64)
+
+struct slab {
+	// Link in the partial list of the size class, or in the list of empty slabs
+	struct slab *prev;
+	struct slab *next;
+
+	unsigned int size;
+	unsigned int capacity;
+	unsigned int used;
+	// First word of free_map that may have a free object
+	unsigned int hint;
+
+	// A set bit means the object is free
+	unsigned long free_map[SLAB_MAP_WORDS];
+};
+
+#define SLAB_OBJECTS ((sizeof(struct slab) + 15) & ~15UL)
+
+// Slabs with free objects, for each size class
+static struct slab *partial[SLAB_CLASSES];
+// Slabs with no object in use, they can be given to any size class
+static struct slab *empty_slabs;
+
+static void *slab_base;
+static void *slab_end;
+static void *slab_top;
+
+#ifdef OSMEM_THREAD_SAFE
+static pthread_mutex_t class_mutex[SLAB_CLASSES] = { [0 ... SLAB_CLASSES - 1] = PTHREAD_MUTEX_INITIALIZER };
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t slab_once = PTHREAD_ONCE_INIT;
+#define class_lock(cls)		pthread_mutex_lock(&class_mutex[cls])
+#define class_unlock(cls)	pthread_mutex_unlock(&class_mutex[cls])
+#define pool_lock()		pthread_mutex_lock(&pool_mutex)
+#define pool_unlock()		pthread_mutex_unlock(&pool_mutex)
+#define slab_init_once()	pthread_once(&slab_once, slab_init)
+
+void slab_fork(int stage)
+{
+	for (int cls = 0; cls < SLAB_CLASSES; cls++)
+		fork_mutex(&class_mutex[cls], stage);
+	fork_mutex(&pool_mutex, stage);
+}
+#else
+static int slab_ready;
+#define class_lock(cls)		do {} while (0)
+#define class_unlock(cls)	do {} while (0)
+#define pool_lock()		do {} while (0)
+#define pool_unlock()		do {} while (0)
+#define slab_init_once()	do { if (!slab_ready) { slab_init(); slab_ready = 1; } } while (0)
+#endif
+
+// This function reserves the slab region if the slabs are enabled with OSMEM_SLAB=1
+void slab_init(void)
+{
+	if (!config.slab)
+		return;
+
+	void *start = reserve_region(SLAB_REGION_SIZE, SLAB_SIZE);
+
+	// Without the region, every request goes to the heap
+	if (!start)
+		return;
+
+	slab_top = start;
+	slab_end = start + SLAB_REGION_SIZE;
+	// slab_base is set last, slab_owns() is called without any lock
+	__atomic_store_n(&slab_base, start, __ATOMIC_RELEASE);
+}
+
+int slab_owns(void *ptr)
+{
+	void *base = __atomic_load_n(&slab_base, __ATOMIC_ACQUIRE);
+
+	return base && ptr >= base && ptr < slab_end;
+}
+
+// This function returns the slab an object belongs to
+struct slab *slab_of(void *ptr)
+{
+	return (struct slab *)((unsigned long)ptr & ~(SLAB_SIZE - 1UL));
+}
+
+void slab_list_remove(struct slab **head, struct slab *slab)
+{
+	if (slab->prev)
+		slab->prev->next = slab->next;
+	else
+		*head = slab->next;
+	if (slab->next)
+		slab->next->prev = slab->prev;
+	slab->prev = NULL;
+	slab->next = NULL;
+}
+
+void slab_list_push(struct slab **head, struct slab *slab)
+{
+	slab->prev = NULL;
+	slab->next = *head;
+	if (*head)
+		(*head)->prev = slab;
+	*head = slab;
+}
+
+// This function takes an empty slab, or a new one from the region, for objects of the given size
+struct slab *new_slab(unsigned int size)
+{
+	struct slab *slab;
+
+	pool_lock();
+	slab = empty_slabs;
+	if (slab) {
+		slab_list_remove(&empty_slabs, slab);
+	} else if (slab_top < slab_end) {
+		slab = slab_top;
+		slab_top += SLAB_SIZE;
+	}
+	pool_unlock();
+
+	if (!slab)
+		return NULL;
+
+	slab->size = size;
+	slab->capacity = (SLAB_SIZE - SLAB_OBJECTS) / size;
+	slab->used = 0;
+	slab->hint = 0;
+
+	memset(slab->free_map, 0, sizeof(slab->free_map));
+	for (unsigned int i = 0; i < slab->capacity / 64; i++)
+		slab->free_map[i] = ~0UL;
+	if (slab->capacity % 64)
+		slab->free_map[slab->capacity / 64] = (1UL << (slab->capacity % 64)) - 1;
+
+	return slab;
+}
+
+void *slab_malloc(size_t size)
+{
+	if (size == 0 || size > SLAB_MAX)
+		return NULL;
+
+	slab_init_once();
+	if (!slab_base)
+		return NULL;
+
+	size_t cls = (size - 1) / 16;
+	struct slab *slab;
+
+	class_lock(cls);
+	slab = partial[cls];
+	if (!slab) {
+		slab = new_slab((cls + 1) * 16);
+		if (!slab) {
+			class_unlock(cls);
+			return NULL;
+		}
+		slab_list_push(&partial[cls], slab);
+	}
+
+	// A slab on the partial list always has a free object at or after its hint
+	while (!slab->free_map[slab->hint])
+		slab->hint++;
+
+	unsigned int idx = slab->hint * 64 + __builtin_ctzl(slab->free_map[slab->hint]);
+
+	slab->free_map[slab->hint] &= ~(1UL << (idx % 64));
+	if (++slab->used == slab->capacity)
+		slab_list_remove(&partial[cls], slab);
+	class_unlock(cls);
+
+	stat_add(slab_hits, 1);
+	stat_add(slab_bytes, slab->size);
+
+	return (void *)slab + SLAB_OBJECTS + (size_t)idx * slab->size;
+}
+
+void slab_free(void *ptr, void *caller)
+{
+	struct slab *slab = slab_of(ptr);
+	size_t cls = slab->size / 16 - 1;
+	unsigned int idx = (ptr - (void *)slab - SLAB_OBJECTS) / slab->size;
+
+	class_lock(cls);
+	// An object freed twice already has its bit set, it is left alone like a block of the heap
+	// freed twice, and only reported in the debug mode
+	if (slab->free_map[idx / 64] & (1UL << (idx % 64))) {
+		class_unlock(cls);
+		if (config.debug)
+			debug_report("double free", ptr, caller);
+		return;
+	}
+
+	slab->free_map[idx / 64] |= 1UL << (idx % 64);
+	stat_sub(slab_bytes, slab->size);
+	if (idx / 64 < slab->hint)
+		slab->hint = idx / 64;
+
+	// A full slab gets back on the partial list, an empty one is given back to the pool
+	// unless it is the last slab of its size class
+	if (slab->used-- == slab->capacity)
+		slab_list_push(&partial[cls], slab);
+
+	if (slab->used == 0 && (slab->prev || slab->next)) {
+		slab_list_remove(&partial[cls], slab);
+		class_unlock(cls);
+
+		pool_lock();
+		slab_list_push(&empty_slabs, slab);
+		pool_unlock();
+		return;
+	}
+	class_unlock(cls);
+}
+
+// This function returns the usable size of an object
+size_t slab_size(void *ptr)
+{
+	return slab_of(ptr)->size;
+}
+
+void *slab_realloc(void *ptr, size_t size, void *caller)
+{
+	if (size == 0) {
+		slab_free(ptr, caller);
+		return NULL;
+	}
+
+	// The object already has room for the new size
+	if (size <= slab_size(ptr))
+		return ptr;
+
+	void *new_ptr = do_malloc(size);
+
+	if (!new_ptr)
+		return NULL;
+
+	memcpy(new_ptr, ptr, slab_size(ptr));
+	slab_free(ptr, caller);
+
+	return new_ptr;
+}
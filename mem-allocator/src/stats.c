@@ -0,0 +1,153 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "heap.h"
+
+struct osmem_counters counters;
+
+void stats_flush(struct stats_out *out)
+{
+	// The statistics are best effort, a failed write is not an error of the allocator
+	ssize_t ret = write(out->fd, out->buf, out->len);
+
+	(void)ret;
+	out->len = 0;
+}
+
+void stats_putchar(char character, void *arg)
+{
+	struct stats_out *out = arg;
+
+	out->buf[out->len++] = character;
+	if (out->len == sizeof(out->buf))
+		stats_flush(out);
+}
+
+// This function returns the smallest size of the blocks in a size class
+size_t bin_min_size(size_t idx)
+{
+	if (idx < N_SMALL_BINS)
+		return (idx + 1) * 8;
+
+	// The first class after the exact ones starts right after them
+	if (idx == N_SMALL_BINS)
+		return SMALL_BIN_MAX + 8;
+
+	size_t order = (idx - N_SMALL_BINS) / 4 + 10;
+
+	return (4 + (idx - N_SMALL_BINS) % 4) << (order - 2);
+}
+
+int os_malloc_info(struct os_malloc_info *info)
+{
+	if (!info)
+		return -1;
+
+	memset(info, 0, sizeof(*info));
+
+	// Walk the blocks of every arena in use
+	for (int idx = 0; idx < os_arena_count(); idx++) {
+		struct arena *arena = created_arena(idx);
+
+		if (!arena)
+			continue;
+
+		heap_lock(arena);
+		heap_settle(arena);
+		info->heap_size += arena->heap_end - arena->heap_start;
+		for (struct block_meta *block = arena->list_head; block; block = next_block(arena, block)) {
+			if (block->status == STATUS_FREE) {
+				info->free_bytes += block->size;
+				if (block->size > info->largest_free)
+					info->largest_free = block->size;
+			} else {
+				info->in_use_bytes += block->size;
+			}
+		}
+		heap_unlock(arena);
+	}
+
+	info->mapped_bytes = __atomic_load_n(&counters.mapped_bytes, __ATOMIC_RELAXED);
+	info->mapped_blocks = __atomic_load_n(&counters.mapped_blocks, __ATOMIC_RELAXED);
+	info->slab_bytes = __atomic_load_n(&counters.slab_bytes, __ATOMIC_RELAXED);
+	info->in_use_bytes += info->mapped_bytes + info->slab_bytes;
+
+	// The share of the free memory that cannot be used for a request as big as all of it
+	if (info->free_bytes)
+		info->fragmentation = 1.0 - (double)info->largest_free / info->free_bytes;
+
+	info->sbrk_calls = counters.sbrk_calls;
+	info->sbrk_bytes = counters.sbrk_bytes;
+	info->trimmed_bytes = counters.trimmed_bytes;
+	info->mmap_calls = counters.mmap_calls;
+	info->mmap_bytes = counters.mmap_bytes;
+	info->munmap_calls = counters.munmap_calls;
+	info->mremap_calls = counters.mremap_calls;
+	info->madvise_calls = counters.madvise_calls;
+	info->splits = counters.splits;
+	info->coalesces = counters.coalesces;
+	info->slab_hits = counters.slab_hits;
+	info->tcache_hits = counters.tcache_hits;
+	for (size_t i = 0; i < N_BINS; i++)
+		info->free_list_hits += counters.class_hits[i];
+
+	return 0;
+}
+
+int os_malloc_class_hits(int idx, size_t *min_size, unsigned long *hits)
+{
+	if (idx < 0 || idx >= N_BINS)
+		return -1;
+
+	if (min_size)
+		*min_size = bin_min_size(idx);
+	if (hits)
+		*hits = __atomic_load_n(&counters.class_hits[idx], __ATOMIC_RELAXED);
+
+	return 0;
+}
+
+void os_malloc_stats(void)
+{
+	struct stats_out out = { .fd = STDERR_FILENO };
+	struct os_malloc_info info;
+
+	os_malloc_info(&info);
+
+	fctprintf(stats_putchar, &out, "osmem statistics\n");
+	fctprintf(stats_putchar, &out, "heap:          %zu bytes in %d arenas\n", info.heap_size, os_arena_count());
+	fctprintf(stats_putchar, &out, "in use:        %zu bytes (%zu mapped, %zu in slabs)\n",
+			  info.in_use_bytes, info.mapped_bytes, info.slab_bytes);
+	fctprintf(stats_putchar, &out, "free:          %zu bytes, largest block %zu bytes, fragmentation %.3f\n",
+			  info.free_bytes, info.largest_free, info.fragmentation);
+	fctprintf(stats_putchar, &out, "mapped blocks: %zu\n", info.mapped_blocks);
+	fctprintf(stats_putchar, &out, "sbrk:          %lu calls, %zu bytes grown, %zu bytes trimmed\n",
+			  info.sbrk_calls, info.sbrk_bytes, info.trimmed_bytes);
+	fctprintf(stats_putchar, &out, "mmap:          %lu calls, %zu bytes\n", info.mmap_calls, info.mmap_bytes);
+	fctprintf(stats_putchar, &out, "munmap:        %lu calls\n", info.munmap_calls);
+	fctprintf(stats_putchar, &out, "mremap:        %lu calls\n", info.mremap_calls);
+	fctprintf(stats_putchar, &out, "madvise:       %lu calls\n", info.madvise_calls);
+	fctprintf(stats_putchar, &out, "splits:        %lu\n", info.splits);
+	fctprintf(stats_putchar, &out, "coalesces:     %lu\n", info.coalesces);
+	fctprintf(stats_putchar, &out, "slab hits:     %lu\n", info.slab_hits);
+	fctprintf(stats_putchar, &out, "tcache hits:   %lu\n", info.tcache_hits);
+	fctprintf(stats_putchar, &out, "free list hits by size class: %lu\n", info.free_list_hits);
+
+	for (int idx = 0; idx < N_BINS; idx++) {
+		size_t min_size;
+		unsigned long hits;
+
+		os_malloc_class_hits(idx, &min_size, &hits);
+		if (hits)
+			fctprintf(stats_putchar, &out, "  %8zu+ bytes: %lu\n", min_size, hits);
+	}
+
+	stats_flush(&out);
+}
+
+// This function prints the statistics when the program exits if OSMEM_STATS=1
+__attribute__((destructor))
+void stats_at_exit(void)
+{
+	if (config.stats)
+		os_malloc_stats();
+}
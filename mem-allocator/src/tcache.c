@@ -0,0 +1,136 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <pthread.h>
+
+#include "heap.h"
+
+// Blocks up to TCACHE_MAX bytes are cached per thread, in one list for each 8 bytes of size
+#define TCACHE_MAX 512
+#define TCACHE_BINS (TCACHE_MAX / 8)
+// Maximum number of blocks kept in a list
+#define TCACHE_COUNT 16
+// Number of blocks taken from the heap under one lock when a list is empty
+#define TCACHE_REFILL 8
+
+// The cached blocks are still allocated as far as their arena is concerned,
+// they are chained through the first word of their payload
+struct tcache {
+	void *head[TCACHE_BINS];
+	unsigned short count[TCACHE_BINS];
+	int registered;
+};
+
+static __thread struct tcache tcache __attribute__((tls_model("initial-exec")));
+
+static pthread_key_t tcache_key;
+static pthread_once_t tcache_once = PTHREAD_ONCE_INIT;
+
+// This function gives the blocks cached by an exiting thread back to the heap
+void tcache_flush(void *arg)
+{
+	struct tcache *cache = arg;
+
+	for (int i = 0; i < TCACHE_BINS; i++) {
+		while (cache->head[i]) {
+			void *ptr = cache->head[i];
+
+			cache->head[i] = *(void **)ptr;
+			arena_free(ptr);
+		}
+		cache->count[i] = 0;
+	}
+
+	cache->registered = 0;
+}
+
+void tcache_create_key(void)
+{
+	pthread_key_create(&tcache_key, tcache_flush);
+}
+
+// This function makes sure the cache of the current thread is flushed when the thread exits
+void tcache_register(void)
+{
+	pthread_once(&tcache_once, tcache_create_key);
+	pthread_setspecific(tcache_key, &tcache);
+	tcache.registered = 1;
+}
+
+// This function adds an allocated block to the cache, returns 0 if its list is full or if the block
+// belongs to an arena the thread does not allocate from, which gets it back through its remote queue
+int tcache_put(void *ptr)
+{
+	struct block_meta *block = ptr - META_SIZE - padding(META_SIZE);
+	size_t idx = block->size / 8 - 1;
+
+	if (block->size > TCACHE_MAX || tcache.count[idx] == TCACHE_COUNT || !arena_is_local(arena_of(block)))
+		return 0;
+
+	if (!tcache.registered)
+		tcache_register();
+
+	*(void **)ptr = tcache.head[idx];
+	tcache.head[idx] = ptr;
+	tcache.count[idx]++;
+
+	return 1;
+}
+
+// This function takes a batch of blocks of the given size from the arena of the thread,
+// returns the first one and caches the others
+void *tcache_refill(size_t size)
+{
+	struct arena *arena = thread_arena();
+	void *ptr[TCACHE_REFILL];
+	int n = 0;
+
+	// The batch stops early when there is no memory left
+	heap_lock(arena);
+	while (n < TCACHE_REFILL && (ptr[n] = heap_malloc(arena, size)))
+		n++;
+	heap_unlock(arena);
+
+	if (!n)
+		return NULL;
+
+	// The blocks that do not fit in the cache go back to the arena
+	for (int i = n - 1; i > 0; i--) {
+		if (!tcache_put(ptr[i]))
+			arena_free(ptr[i]);
+	}
+
+	return ptr[0];
+}
+
+void *tcache_malloc(size_t size)
+{
+	size_t size_block = size + padding(size);
+
+	if (size == 0 || size_block > TCACHE_MAX)
+		return NULL;
+
+	size_t idx = size_block / 8 - 1;
+
+	// If the list is empty, refill it from the heap
+	if (!tcache.head[idx])
+		return tcache_refill(size_block);
+
+	void *ptr = tcache.head[idx];
+
+	tcache.head[idx] = *(void **)ptr;
+	tcache.count[idx]--;
+	stat_add(tcache_hits, 1);
+
+	return ptr;
+}
+
+int tcache_free(void *ptr)
+{
+	struct block_meta *block = ptr - META_SIZE - padding(META_SIZE);
+
+	// Mapped blocks are released right away
+	if (block->status != STATUS_ALLOC)
+		return 0;
+
+	return tcache_put(ptr);
+}
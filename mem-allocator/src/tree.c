@@ -0,0 +1,389 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "heap.h"
+
+// The free blocks are kept in trees ordered by size and then by address, so that the best fit
+// (the smallest block big enough, the lowest one of that size) is found in O(log n) and a block
+// is added or removed in O(log n) too. The nodes are in the payload of the blocks and their links
+// are offsets from the heap start.
+//
+// Each size class below TREE_MIN is a splay tree: its nodes are only two links, which fit in the
+// smallest payload a block can have. The blocks of at least TREE_MIN bytes are all in a single
+// red-black tree.
+
+// This function returns 1 if the block of the given size at the given address comes before block
+int key_before(size_t size, void *addr, struct block_meta *block)
+{
+	return size < block->size || (size == block->size && addr < (void *)block);
+}
+
+// This function moves the node closest to the key (size, addr) to the root of a splay tree
+// (top-down splay) and returns the new root. The nodes passed on the way are hooked to a left tree
+// (smaller than the key) and a right tree (bigger), which become the subtrees of the new root.
+unsigned int splay(struct arena *arena, unsigned int root, size_t size, void *addr)
+{
+	unsigned int left_tree = 0, right_tree = 0;
+	unsigned int *left_hook = &left_tree, *right_hook = &right_tree;
+	struct block_meta *top = link_to_block(arena, root);
+
+	for (;;) {
+		struct free_links *links = get_links(top);
+
+		if (key_before(size, addr, top)) {
+			struct block_meta *child = link_to_block(arena, links->left);
+
+			if (!child)
+				break;
+			// Zig-zig: rotate right first
+			if (key_before(size, addr, child)) {
+				links->left = get_links(child)->right;
+				get_links(child)->right = block_to_link(arena, top);
+				top = child;
+				links = get_links(top);
+				if (!links->left)
+					break;
+			}
+			*right_hook = block_to_link(arena, top);
+			right_hook = &links->left;
+			top = link_to_block(arena, links->left);
+		} else if (size != top->size || addr != (void *)top) {
+			struct block_meta *child = link_to_block(arena, links->right);
+
+			if (!child)
+				break;
+			if (!key_before(size, addr, child) && (size != child->size || addr != (void *)child)) {
+				links->right = get_links(child)->left;
+				get_links(child)->left = block_to_link(arena, top);
+				top = child;
+				links = get_links(top);
+				if (!links->right)
+					break;
+			}
+			*left_hook = block_to_link(arena, top);
+			left_hook = &links->right;
+			top = link_to_block(arena, links->right);
+		} else {
+			break;
+		}
+	}
+
+	struct free_links *links = get_links(top);
+
+	*left_hook = links->left;
+	*right_hook = links->right;
+	links->left = left_tree;
+	links->right = right_tree;
+
+	return block_to_link(arena, top);
+}
+
+void class_insert(struct arena *arena, size_t idx, struct block_meta *block)
+{
+	struct free_links *links = get_links(block);
+
+	if (!arena->bins[idx]) {
+		links->left = 0;
+		links->right = 0;
+	} else {
+		// The block goes between the closest node and its subtree on the side of the block
+		struct block_meta *root = link_to_block(arena, splay(arena, arena->bins[idx], block->size, block));
+		struct free_links *root_links = get_links(root);
+
+		if (key_before(block->size, block, root)) {
+			links->left = root_links->left;
+			links->right = block_to_link(arena, root);
+			root_links->left = 0;
+		} else {
+			links->right = root_links->right;
+			links->left = block_to_link(arena, root);
+			root_links->right = 0;
+		}
+	}
+
+	arena->bins[idx] = block_to_link(arena, block);
+}
+
+void class_remove(struct arena *arena, size_t idx, struct block_meta *block)
+{
+	struct free_links *links = get_links(block);
+
+	splay(arena, arena->bins[idx], block->size, block);
+
+	// The biggest block of the left subtree has no right child once splayed, the right subtree goes there
+	if (!links->left) {
+		arena->bins[idx] = links->right;
+	} else {
+		unsigned int root = splay(arena, links->left, block->size, block);
+
+		get_links(link_to_block(arena, root))->right = links->right;
+		arena->bins[idx] = root;
+	}
+}
+
+// This function returns the smallest free block of at least size bytes in a size class,
+// the one with the lowest address among those of that size, or NULL if there is none
+struct block_meta *class_best_fit(struct arena *arena, size_t idx, size_t size)
+{
+	if (!arena->bins[idx])
+		return NULL;
+
+	// No block comes before the key (size, NULL), the root is then its predecessor or its successor
+	arena->bins[idx] = splay(arena, arena->bins[idx], size, NULL);
+
+	struct block_meta *best = link_to_block(arena, arena->bins[idx]);
+
+	if (best->size >= size)
+		return best;
+
+	best = link_to_block(arena, get_links(best)->right);
+	while (best && get_links(best)->left)
+		best = link_to_block(arena, get_links(best)->left);
+
+	return best;
+}
+
+struct tree_node *node_of(struct block_meta *block)
+{
+	return (struct tree_node *)((void *)block + META_SIZE + padding(META_SIZE));
+}
+
+struct block_meta *tree_left(struct arena *arena, struct block_meta *block)
+{
+	return link_to_block(arena, node_of(block)->left);
+}
+
+struct block_meta *tree_right(struct arena *arena, struct block_meta *block)
+{
+	return link_to_block(arena, node_of(block)->right);
+}
+
+struct block_meta *tree_parent(struct arena *arena, struct block_meta *block)
+{
+	return link_to_block(arena, node_of(block)->parent);
+}
+
+// Missing children are black
+int is_red(struct block_meta *block)
+{
+	return block && node_of(block)->red;
+}
+
+int tree_before(struct block_meta *a, struct block_meta *b)
+{
+	return a->size < b->size || (a->size == b->size && a < b);
+}
+
+// This function makes new_child take the place of child under the parent of child
+void replace_child(struct arena *arena, struct block_meta *child, struct block_meta *new_child)
+{
+	struct block_meta *parent = tree_parent(arena, child);
+	unsigned int link = block_to_link(arena, new_child);
+
+	if (!parent)
+		arena->free_tree = link;
+	else if (tree_left(arena, parent) == child)
+		node_of(parent)->left = link;
+	else
+		node_of(parent)->right = link;
+
+	if (new_child)
+		node_of(new_child)->parent = node_of(child)->parent;
+}
+
+void rotate_left(struct arena *arena, struct block_meta *block)
+{
+	struct block_meta *right = tree_right(arena, block);
+	struct tree_node *node = node_of(block);
+
+	replace_child(arena, block, right);
+	node->right = node_of(right)->left;
+	if (node->right)
+		node_of(tree_right(arena, block))->parent = block_to_link(arena, block);
+	node_of(right)->left = block_to_link(arena, block);
+	node->parent = block_to_link(arena, right);
+}
+
+void rotate_right(struct arena *arena, struct block_meta *block)
+{
+	struct block_meta *left = tree_left(arena, block);
+	struct tree_node *node = node_of(block);
+
+	replace_child(arena, block, left);
+	node->left = node_of(left)->right;
+	if (node->left)
+		node_of(tree_left(arena, block))->parent = block_to_link(arena, block);
+	node_of(left)->right = block_to_link(arena, block);
+	node->parent = block_to_link(arena, left);
+}
+
+void tree_insert(struct arena *arena, struct block_meta *block)
+{
+	struct tree_node *node = node_of(block);
+	struct block_meta *parent = NULL;
+	struct block_meta *current = link_to_block(arena, arena->free_tree);
+
+	while (current) {
+		parent = current;
+		current = tree_before(block, current) ? tree_left(arena, current) : tree_right(arena, current);
+	}
+
+	node->left = 0;
+	node->right = 0;
+	node->parent = block_to_link(arena, parent);
+	node->red = 1;
+	heap_dirty(arena, node + 1);
+
+	if (!parent)
+		arena->free_tree = block_to_link(arena, block);
+	else if (tree_before(block, parent))
+		node_of(parent)->left = block_to_link(arena, block);
+	else
+		node_of(parent)->right = block_to_link(arena, block);
+
+	// Restore the colours: a red node must not have a red parent
+	while (is_red(parent = tree_parent(arena, block))) {
+		struct block_meta *grandparent = tree_parent(arena, parent);
+		int left_side = tree_left(arena, grandparent) == parent;
+		struct block_meta *uncle = left_side ? tree_right(arena, grandparent) : tree_left(arena, grandparent);
+
+		if (is_red(uncle)) {
+			node_of(parent)->red = 0;
+			node_of(uncle)->red = 0;
+			node_of(grandparent)->red = 1;
+			block = grandparent;
+			continue;
+		}
+
+		if (left_side) {
+			if (tree_right(arena, parent) == block) {
+				rotate_left(arena, parent);
+				block = parent;
+				parent = tree_parent(arena, block);
+			}
+			rotate_right(arena, grandparent);
+		} else {
+			if (tree_left(arena, parent) == block) {
+				rotate_right(arena, parent);
+				block = parent;
+				parent = tree_parent(arena, block);
+			}
+			rotate_left(arena, grandparent);
+		}
+		node_of(parent)->red = 0;
+		node_of(grandparent)->red = 1;
+		break;
+	}
+
+	node_of(link_to_block(arena, arena->free_tree))->red = 0;
+}
+
+void tree_remove(struct arena *arena, struct block_meta *block)
+{
+	struct tree_node *node = node_of(block);
+	struct block_meta *child, *parent;
+	int removed_red;
+
+	if (!node->left || !node->right) {
+		child = node->left ? tree_left(arena, block) : tree_right(arena, block);
+		parent = tree_parent(arena, block);
+		removed_red = node->red;
+		replace_child(arena, block, child);
+	} else {
+		// The next block in order takes the place of the removed one
+		struct block_meta *next = tree_right(arena, block);
+
+		while (tree_left(arena, next))
+			next = tree_left(arena, next);
+
+		struct tree_node *next_node = node_of(next);
+
+		child = tree_right(arena, next);
+		removed_red = next_node->red;
+
+		if (tree_parent(arena, next) == block) {
+			parent = next;
+		} else {
+			parent = tree_parent(arena, next);
+			replace_child(arena, next, child);
+			next_node->right = node->right;
+			node_of(tree_right(arena, next))->parent = block_to_link(arena, next);
+		}
+
+		replace_child(arena, block, next);
+		next_node->left = node->left;
+		node_of(tree_left(arena, next))->parent = block_to_link(arena, next);
+		next_node->red = node->red;
+	}
+
+	if (removed_red)
+		return;
+
+	// A black node is gone from the paths through child, make up for it
+	while (child != link_to_block(arena, arena->free_tree) && !is_red(child)) {
+		int left_side = tree_left(arena, parent) == child;
+		struct block_meta *sibling = left_side ? tree_right(arena, parent) : tree_left(arena, parent);
+
+		if (is_red(sibling)) {
+			node_of(sibling)->red = 0;
+			node_of(parent)->red = 1;
+			if (left_side)
+				rotate_left(arena, parent);
+			else
+				rotate_right(arena, parent);
+			sibling = left_side ? tree_right(arena, parent) : tree_left(arena, parent);
+		}
+
+		struct block_meta *near = left_side ? tree_left(arena, sibling) : tree_right(arena, sibling);
+		struct block_meta *far = left_side ? tree_right(arena, sibling) : tree_left(arena, sibling);
+
+		if (!is_red(near) && !is_red(far)) {
+			node_of(sibling)->red = 1;
+			child = parent;
+			parent = tree_parent(arena, child);
+			continue;
+		}
+
+		if (!is_red(far)) {
+			node_of(near)->red = 0;
+			node_of(sibling)->red = 1;
+			if (left_side)
+				rotate_right(arena, sibling);
+			else
+				rotate_left(arena, sibling);
+			far = sibling;
+			sibling = near;
+		}
+
+		node_of(sibling)->red = node_of(parent)->red;
+		node_of(parent)->red = 0;
+		node_of(far)->red = 0;
+		if (left_side)
+			rotate_left(arena, parent);
+		else
+			rotate_right(arena, parent);
+		child = link_to_block(arena, arena->free_tree);
+		break;
+	}
+
+	if (child)
+		node_of(child)->red = 0;
+}
+
+// This function returns the smallest free block of at least size bytes in the tree,
+// the one with the lowest address among those of that size, or NULL if there is none
+struct block_meta *tree_best_fit(struct arena *arena, size_t size)
+{
+	struct block_meta *best = NULL;
+	struct block_meta *current = link_to_block(arena, arena->free_tree);
+
+	while (current) {
+		if (current->size >= size) {
+			best = current;
+			current = tree_left(arena, current);
+		} else {
+			current = tree_right(arena, current);
+		}
+	}
+
+	return best;
+}
@@ -48,6 +48,7 @@ TESTS = {
     "test-realloc-coalesce": 3,
     "test-realloc-coalesce-big": 1,
     "test-all": 5,
+    "test-memalign": 3,
 }
 
 
@@ -153,6 +154,9 @@ class LtraceParser:
         "os_calloc",
         "os_realloc",
         "os_free",
+        "os_memalign",
+        "os_aligned_alloc",
+        "os_posix_memalign",
         "brk",
         "mmap",
         "munmap",
@@ -473,7 +477,7 @@ def main():
         if test.grade(verbose, diff, memcheck):
             total += score
 
-    print("\nTotal:" + " " * 59 + f" {total}/100")
+    print("\nTotal:" + " " * 59 + f" {total}/{sum(TESTS.values())}")
 
 
 if __name__ == "__main__":
@@ -0,0 +1,49 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "test-utils.h"
+
+int main(void)
+{
+	void *prealloc_ptr, *ptrs[NUM_SZ_SM], *aligned[4];
+	struct os_arena_stats stats;
+	size_t free_blocks;
+
+	/* Create a list of blocks starting with a free block */
+	prealloc_ptr = mock_preallocate();
+	for (int i = 0; i < NUM_SZ_SM; i++)
+		ptrs[i] = os_malloc_checked(inc_sz_sm[i]);
+	os_free(prealloc_ptr);
+
+	/* Carve aligned blocks out of the first free block */
+	aligned[0] = os_memalign_checked(64, 100);
+	aligned[1] = os_memalign_checked(4096, 1000);
+
+	/* Carve an aligned block out of a free block between allocated blocks */
+	os_free(ptrs[9]);
+	aligned[2] = os_memalign_checked(256, 1000);
+
+	/* Carve a big aligned block out of what is left of the first free block */
+	aligned[3] = os_aligned_alloc(512, 50000);
+	FAIL(aligned[3] == NULL || (unsigned long)aligned[3] % 512 != 0, "DBG: os_aligned_alloc returned unaligned memory");
+
+	/* An alignment of 0 is rejected before the pointer is written */
+	FAIL(os_posix_memalign(NULL, 0, 100) != EINVAL, "DBG: os_posix_memalign accepted an alignment of 0");
+
+	/* Cleanup */
+	for (int i = 0; i < 4; i++)
+		os_free(aligned[i]);
+	for (int i = 0; i < NUM_SZ_SM; i++)
+		if (i != 9)
+			os_free(ptrs[i]);
+
+	/* An aligned block is merged back with the free blocks around it */
+	FAIL(os_arena_stats(0, &stats), "DBG: os_arena_stats failed");
+	free_blocks = stats.free_blocks;
+	prealloc_ptr = os_malloc_checked(1000);
+	aligned[0] = os_memalign_checked(256, 1000);
+	os_free(aligned[0]);
+	os_free(prealloc_ptr);
+	FAIL(os_arena_stats(0, &stats) || stats.free_blocks != free_blocks, "DBG: os_memalign left a split free block");
+
+	return 0;
+}
@@ -101,6 +101,18 @@ void *os_realloc_checked(void *ptr, size_t size)
 	return ptr_realloc;
 }
 
+void *os_memalign_checked(size_t alignment, size_t size)
+{
+	void *ptr = os_memalign(alignment, size);
+
+	if (size != 0) {
+		FAIL(ptr == NULL, "DBG: os_memalign returned NULL on valid size");
+		FAIL((unsigned long)ptr % alignment != 0, "DBG: os_memalign returned unaligned memory");
+	}
+
+	return ptr;
+}
+
 void *mock_preallocate(void)
 {
 	return os_malloc(MOCK_PREALLOC);
@@ -0,0 +1,48 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <pthread.h>
+#include "../snippets/test-utils.h"
+
+static void *ptrs[3];
+
+static void *alloc_thread(void *arg)
+{
+	(void)arg;
+
+	/* Three adjacent blocks in the arena of this thread, too big for the slabs and the cache */
+	for (int i = 0; i < 3; i++)
+		ptrs[i] = os_malloc_checked(1000);
+
+	return NULL;
+}
+
+int main(void)
+{
+	struct os_malloc_info info;
+	struct os_arena_stats stats;
+	pthread_t thread;
+
+	FAIL(os_arena_count() < 2, "DBG: run with OSMEM_ARENAS=2 on the thread-safe build");
+
+	FAIL(pthread_create(&thread, NULL, alloc_thread, NULL), "DBG: pthread_create failed");
+	pthread_join(thread, NULL);
+
+	/* Move the first block away, it stays merged but out of the bins until the next operation */
+	ptrs[0] = os_realloc_checked(ptrs[0], 3000);
+
+	/* Queue the second block, the arena frees it next to the moved block */
+	os_free(ptrs[1]);
+
+	/* The statistics drain the queue */
+	FAIL(os_malloc_info(&info), "DBG: os_malloc_info failed");
+	for (int i = 0; i < os_arena_count(); i++)
+		FAIL(os_arena_stats(i, &stats), "DBG: os_arena_stats failed");
+
+	/* Once the other blocks are freed, nothing is left in use */
+	os_free(ptrs[0]);
+	os_free(ptrs[2]);
+	FAIL(os_malloc_info(&info), "DBG: os_malloc_info failed");
+	FAIL(info.in_use_bytes != info.slab_bytes + info.mapped_bytes, "DBG: freed blocks are still counted as in use");
+
+	return 0;
+}
@@ -16,12 +16,27 @@
 	} while (0)
 
 /* Structure to hold memory block metadata */
+#ifdef OSMEM_COMPACT
+/* Compact 16 byte header: the status is packed in the low bits of the size word, the next block
+ * of a heap starts right after the payload and the previous one is found from its distance.
+ * Mapped blocks keep the links of their index in the 16 bytes before the header.
+ */
+struct block_meta {
+	size_t status : 2;
+	size_t size : 62;
+	/* Distance to the previous block of the heap in 8 byte units, 0 for the first block */
+	unsigned int prev_offset;
+	unsigned int next_freed;
+};
+#else
 struct block_meta {
 	size_t size;
 	int status;
+	unsigned int next_freed;
 	struct block_meta *prev;
 	struct block_meta *next;
 };
+#endif
 
 /* Block metadata status values */
 #define STATUS_FREE   0
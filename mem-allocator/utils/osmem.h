@@ -14,3 +14,69 @@ void *os_malloc(size_t size);
 void os_free(void *ptr);
 void *os_calloc(size_t nmemb, size_t size);
 void *os_realloc(void *ptr, size_t size);
+void *os_memalign(size_t alignment, size_t size);
+void *os_aligned_alloc(size_t alignment, size_t size);
+int os_posix_memalign(void **memptr, size_t alignment, size_t size);
+size_t os_malloc_usable_size(void *ptr);
+void os_free_sized(void *ptr, size_t size);
+size_t os_malloc_batch(size_t size, void **ptrs, size_t count);
+void os_free_batch(void **ptrs, size_t count);
+void *os_malloc_emergency(size_t size);
+
+/* Statistics of one arena, see os_arena_stats() */
+struct os_arena_stats {
+	size_t heap_size;
+	size_t alloc_bytes;
+	size_t free_bytes;
+	size_t alloc_blocks;
+	size_t free_blocks;
+	unsigned long threads;
+	unsigned long locks;
+	unsigned long lock_contentions;
+	unsigned long remote_frees;
+	int node;
+};
+
+int os_arena_count(void);
+int os_arena_stats(int idx, struct os_arena_stats *stats);
+
+/* Statistics of the whole allocator, see os_malloc_info() */
+struct os_malloc_info {
+	size_t heap_size;
+	size_t in_use_bytes;
+	size_t free_bytes;
+	size_t largest_free;
+	double fragmentation;
+	size_t mapped_bytes;
+	size_t mapped_blocks;
+	size_t slab_bytes;
+
+	unsigned long sbrk_calls;
+	size_t sbrk_bytes;
+	size_t trimmed_bytes;
+	unsigned long mmap_calls;
+	size_t mmap_bytes;
+	unsigned long munmap_calls;
+	unsigned long mremap_calls;
+	unsigned long madvise_calls;
+
+	unsigned long splits;
+	unsigned long coalesces;
+	unsigned long free_list_hits;
+	unsigned long slab_hits;
+	unsigned long tcache_hits;
+};
+
+int os_malloc_info(struct os_malloc_info *info);
+int os_malloc_class_hits(int idx, size_t *min_size, unsigned long *hits);
+void os_malloc_stats(void);
+
+int os_malloc_profile_dump(const char *path);
+
+/* Bump-pointer region, its objects are all freed at once by os_region_reset() */
+struct os_region;
+
+struct os_region *os_region_create(size_t chunk_size);
+void *os_region_alloc(struct os_region *region, size_t size);
+void os_region_reset(struct os_region *region);
+void os_region_destroy(struct os_region *region);